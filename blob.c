@@ -0,0 +1,226 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "blob.h"
+#include "cache.h"
+#include "pagepool.h"
+
+/*
+ * Blob store: values, bigger than a page, are written straight to the pool
+ * (see struct BlobHeader), one vectored syscall per extent. Their pages
+ * never get into the cache, whole value is copied only once - from/to
+ * user's buffer.
+ */
+
+#define BLOB_HEADER_SIZE sizeof(struct BlobHeader)
+
+/**
+ * @brief  Reserve extents for value of val_len bytes
+ *
+ * @param[out] ext Array of extents' headers (to be freed by caller)
+ *
+ * @return Number of extents (0 if there's no space in the pool)
+ */
+static size_t blobi_alloc(struct DB *db, size_t val_len,
+			  struct BlobHeader **ext) {
+	struct PagePool *pp = db->pool;
+	size_t count = 0, max = 4, left = val_len;
+	*ext = (struct BlobHeader *)calloc(max, BLOB_HEADER_SIZE);
+	check_mem(*ext, max * BLOB_HEADER_SIZE);
+	while (left > 0) {
+		pageno_t want = (left + BLOB_HEADER_SIZE + pp->page_size - 1) /
+				pp->page_size;
+		pageno_t got  = 0;
+		pageno_t page = pool_alloc_run(pp, want, &got);
+		if (page == 0) {
+			size_t i = 0;
+			log_err("No space for value of %zd bytes", val_len);
+			for (i = 0; i < count; ++i)
+				pool_dealloc_run(pp, (*ext)[i].h.page, (*ext)[i].count);
+			return 0;
+		}
+		if (count == max) {
+			max *= 2;
+			*ext = (struct BlobHeader *)realloc(*ext, max * BLOB_HEADER_SIZE);
+			check_mem(*ext, max * BLOB_HEADER_SIZE);
+		}
+		struct BlobHeader *b = &(*ext)[count++];
+		memset(b, 0, BLOB_HEADER_SIZE);
+		b->h.page  = page;
+		b->h.flags = IS_DATA | IS_BLOB;
+		b->h.size  = got * pp->page_size - BLOB_HEADER_SIZE;
+		if (b->h.size > left) b->h.size = left;
+		b->count   = got;
+		b->total   = val_len;
+		left -= b->h.size;
+		/* Stale copies of these pages mustn't be dumped over the value */
+		for (; got > 0; --got, ++page)
+			cache_page_drop(pp->cache, page);
+	}
+	return count;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief  Store value in the blob store
+ *
+ * @param[out] page First page of the value
+ *
+ * @return Status (-1 if there's no space in the pool)
+ */
+int blob_write(struct DB *db, const void *val, size_t val_len, pageno_t *page) {
+	struct BlobHeader *ext = NULL;
+	size_t count = blobi_alloc(db, val_len, &ext);
+	size_t i = 0, off = 0;
+	if (count == 0) {
+		free(ext);
+		return -1;
+	}
+	for (i = 0; i < count; ++i) {
+		if (i + 1 < count) {
+			ext[i].next      = ext[i + 1].h.page;
+			ext[i].next_size = ext[i + 1].h.size;
+		}
+		struct iovec iov[2] = {
+			{.iov_base = &ext[i], .iov_len = BLOB_HEADER_SIZE},
+			{.iov_base = (char *)val + off, .iov_len = ext[i].h.size},
+		};
+		pool_writev(db->pool, iov, 2, ext[i].h.page, 0);
+		off += ext[i].h.size;
+	}
+	log_info("Value of %zd bytes is written into %zd extent(s) from page %zd",
+		 val_len, count, ext[0].h.page);
+	*page = ext[0].h.page;
+	free(ext);
+	return 0;
+}
+
+/**
+ * @brief  Copy value from the blob store into newly allocated memory
+ *
+ * @return Status
+ */
+int blob_read(struct DB *db, pageno_t page, void **val, size_t *val_len) {
+	struct BlobHeader b;
+	struct iovec iov[2] = {
+		{.iov_base = &b, .iov_len = BLOB_HEADER_SIZE},
+	};
+	pool_readv(db->pool, iov, 1, page, 0);
+	check(b.h.flags & IS_BLOB, "Page %zd isn't a blob", page);
+	char *buf = (char *)malloc(b.total + 1);
+	check_mem(buf, b.total + 1);
+	size_t off = b.h.size;
+	iov[0].iov_base = buf;
+	iov[0].iov_len  = b.h.size;
+	pool_readv(db->pool, iov, 1, page, BLOB_HEADER_SIZE);
+	while (b.next) {
+		check(off + b.next_size <= b.total, "Blob %zd is corrupted", page);
+		iov[0].iov_base = &b;
+		iov[0].iov_len  = BLOB_HEADER_SIZE;
+		iov[1].iov_base = buf + off;
+		iov[1].iov_len  = b.next_size;
+		pool_readv(db->pool, iov, 2, b.next, 0);
+		off += b.h.size;
+	}
+	check(off == b.total, "Blob %zd is corrupted", page);
+	buf[off] = 0;
+	*val = buf;
+	*val_len = off;
+	return 0;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief  Free all extents of the value
+ *
+ * @return Status
+ */
+int blob_free(struct DB *db, pageno_t page) {
+	struct BlobHeader b;
+	struct iovec iov[1] = {
+		{.iov_base = &b, .iov_len = BLOB_HEADER_SIZE},
+	};
+	while (page) {
+		pool_readv(db->pool, iov, 1, page, 0);
+		check(b.h.flags & IS_BLOB, "Page %zd isn't a blob", page);
+		pool_dealloc_run(db->pool, page, b.count);
+		page = b.next;
+	}
+	return 0;
+error:
+	return -1;
+}
+
+/*
+ * Copy count pages of the extent from the page from to the page to
+ */
+static void blobi_copy(struct DB *db, pageno_t from, pageno_t to,
+		       pageno_t count) {
+	struct PagePool *pp = db->pool;
+	pageno_t chunk = (count < 64 ? count : 64), done = 0;
+	char *buf = pool_page_alloc(pp, chunk);
+	for (done = 0; done < count; done += chunk) {
+		if (chunk > count - done)
+			chunk = count - done;
+		struct iovec iov[1] = {
+			{.iov_base = buf, .iov_len = chunk * pp->page_size},
+		};
+		pool_readv(pp, iov, 1, from + done, 0);
+		if (done == 0)
+			((struct BlobHeader *)buf)->h.page = to;
+		pool_writev(pp, iov, 1, to + done, 0);
+	}
+	free(buf);
+}
+
+/**
+ * @brief  Move extents of the value into the first runs of empty pages,
+ *         that are before them (see db_vacuum)
+ *
+ * @param[in,out] page First page of the value
+ *
+ * @return Number of moved pages
+ */
+pageno_t blob_relocate(struct DB *db, pageno_t *page) {
+	struct PagePool *pp = db->pool;
+	struct BlobHeader b, prev;
+	struct iovec iov[1] = {
+		{.iov_base = &b, .iov_len = BLOB_HEADER_SIZE},
+	};
+	pageno_t pos = *page, prev_pos = 0, moved = 0;
+	while (pos) {
+		pool_readv(pp, iov, 1, pos, 0);
+		check(b.h.flags & IS_BLOB, "Page %zd isn't a blob", pos);
+		pageno_t to = pool_alloc_before(pp, pos, b.count), i = 0;
+		if (to) {
+			/* Stale copies of these pages mustn't be dumped over */
+			for (i = 0; i < b.count; ++i)
+				cache_page_drop(pp->cache, to + i);
+			blobi_copy(db, pos, to, b.count);
+			/* Runs are written bypassing the WAL */
+			pool_bitmask_flush(pp);
+			if (prev_pos) {
+				struct iovec piov[1] = {
+					{.iov_base = &prev, .iov_len = BLOB_HEADER_SIZE},
+				};
+				prev.next = to;
+				pool_writev(pp, piov, 1, prev_pos, 0);
+			} else {
+				*page = to;
+			}
+			pool_dealloc_run(pp, pos, b.count);
+			moved   += b.count;
+			b.h.page = to;
+			pos      = to;
+		}
+		prev     = b;
+		prev_pos = pos;
+		pos      = b.next;
+	}
+	return moved;
+error:
+	exit(-1);
+}
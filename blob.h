@@ -0,0 +1,11 @@
+#ifndef _BTREE_BLOB_H_
+#define _BTREE_BLOB_H_
+
+#include "btree.h"
+
+int blob_write(struct DB *db, const void *val, size_t val_len, pageno_t *page);
+int blob_read (struct DB *db, pageno_t page, void **val, size_t *val_len);
+int blob_free (struct DB *db, pageno_t page);
+pageno_t blob_relocate(struct DB *db, pageno_t *page);
+
+#endif /* _BTREE_BLOB_H_ */
@@ -27,18 +27,33 @@
 #include "insert.h"
 #include "search.h"
 #include "delete.h"
+#include "cursor.h"
+#include "bulk.h"
+#include "vacuum.h"
+#include "warm.h"
 
+/*
+ * Space in the BTree page, available for slots and keys
+ */
 uint32_t btree_node_max_capacity(struct DB *db) {
-	double size  = db->pool->page_size;
-	size -= sizeof(struct NodeHeader) - sizeof(pageno_t);
-	size /= 2 * sizeof(pageno_t) + BTREE_KEY_LEN;
-	return (uint32_t )floor(size);
+	return (uint32_t )(NODE_HEAP_END(db->pool->page_size) -
+			   sizeof(struct NodeHeader) - sizeof(pageno_t));
 }
 
 uint32_t data_node_max_capacity(struct DB *db) {
 	return (uint32_t )(db->pool->page_size - sizeof(struct NodeHeader));
 }
 
+/*
+ * Maximum length of value, stored inside of BTree node. It's limited so
+ * every node takes at least 4 keys with inline values of maximum length.
+ */
+uint32_t btree_inline_max(struct DB *db, size_t inline_max) {
+	ssize_t limit = db->node_capacity / 4 - NODE_ENTRY_SIZE(BTREE_KEY_LEN);
+	if (limit < 0) limit = 0;
+	return (uint32_t )(inline_max < limit ? inline_max : limit);
+}
+
 static int dbi_init(struct DB *db, char *db_name, uint16_t page_size,
 	     pageno_t pool_size, size_t cache_size) {
 	memset(db, 0, sizeof(struct DB));
@@ -60,24 +75,35 @@ error:
 	exit(-1);
 }
 
-/**
- * @brief          Initialize DB object
- *
- * @param[out] db       Object to initialize
- * @param[in]  db_name  File for use in Database
- * @param[in]  page_size Size of pages to use in PagePool
- * @param[in]  pool_size Size of pool to use in PagePool
- *
- * @return         Status
+/*
+ * Switch pool to the I/O mode and cache to the replacement policy, asked
+ * for in config (NULL - plain pread/pwrite and CLOCK)
  */
-int db_init(struct DB *db, char *db_name, uint16_t page_size,
-	    pageno_t pool_size, size_t cache_size) {
+static int dbi_pool_io(struct DB *db, char *db_name, struct DBC *config) {
+	if (config && config->use_mmap)
+		check(pool_map(db->pool) == 0, "Can't map DB %s", db_name);
+	if (config && config->use_direct && !config->use_mmap)
+		pool_direct(db->pool, db_name);
+	if (config && config->cache_policy)
+		cache_policy(db->pool->cache, config->cache_policy);
+	return 0;
+error:
+	exit(-1);
+}
+
+static int dbi_create(struct DB *db, char *db_name, uint16_t page_size,
+		      pageno_t pool_size, size_t pool_grow, size_t cache_size,
+		      struct DBC *config) {
 	log_info("Creating DB with name %s", db_name);
 	log_info("PoolSize: %zd, PageSize %i", pool_size, page_size);
 
 	dbi_init(db, db_name, page_size, pool_size, cache_size);
-	pool_init_new(db->pool, db_name, page_size, pool_size, cache_size);
-	db->btree_degree = btree_node_max_capacity(db);
+	pool_init_new(db->pool, db_name, page_size, pool_size, pool_grow,
+		      cache_size);
+	dbi_pool_io(db, db_name, config);
+	db->node_capacity = btree_node_max_capacity(db);
+	db->inline_max = btree_inline_max(db, BTREE_INLINE_MAX);
+	db->compress = (config ? config->compress : 0);
 
 	
 	wal_init(db, db->wal);
@@ -85,28 +111,65 @@ int db_init(struct DB *db, char *db_name, uint16_t page_size,
 	
 	node_btree_load(db, db->top, 0);
 	db->top->h->flags = IS_TOP | IS_LEAF;
+	/* Warm set of the former DB with this name is of no use */
+	warm_drop(db);
+	warm_init(db);
 
-	struct Metadata md = {pool_size, page_size, db->top->h->page};
+	struct Metadata md = {pool_size, page_size, db->top->h->page,
+			      db->inline_max, pool_grow, db->compress};
 	meta_dump(db_name, &md);
 
 	return 0;
 }
 
-int db_load(struct DB *db, char *db_name, size_t cache_size) {
+/**
+ * @brief          Initialize DB object
+ *
+ * @param[out] db       Object to initialize
+ * @param[in]  db_name  File for use in Database
+ * @param[in]  page_size Size of pages to use in PagePool
+ * @param[in]  pool_size Maximum size of pool to use in PagePool (file
+ *                       starts small and grows by POOL_GROW)
+ *
+ * @return         Status
+ */
+int db_init(struct DB *db, char *db_name, uint16_t page_size,
+	    pageno_t pool_size, size_t cache_size) {
+	return dbi_create(db, db_name, page_size, pool_size, POOL_GROW,
+			  cache_size, NULL);
+}
+
+static int dbi_load(struct DB *db, char *db_name, size_t cache_size,
+		    struct DBC *config) {
 	log_info("Loading DB with name %s", db_name);
 
-	struct Metadata md = {0,0,0};
+	struct Metadata md = {0,0,0,0,0,0};
 	meta_load(db_name, &md);
 	log_info("PoolSize: %zd, PageSize %zd", md.pool_size, md.page_size);
 
 	dbi_init(db, db_name, md.page_size, md.pool_size, cache_size);
-	pool_init_old(db->pool, db_name, md.page_size, md.pool_size, cache_size);
-	db->btree_degree = btree_node_max_capacity(db);
+	pool_init_old(db->pool, db_name, md.page_size, md.pool_size,
+		      md.pool_grow, cache_size);
+	dbi_pool_io(db, db_name, config);
+	wal_recover(db);
+	db->node_capacity = btree_node_max_capacity(db);
+	db->inline_max = btree_inline_max(db, md.inline_max);
+	db->compress = md.compress;
+
+	wal_init(db, db->wal);
+	dumper_init(db, db->pool);
+
 	node_btree_load(db, db->top, md.header_page);
+	/* Cache is prewarmed, while DB is used */
+	warm_init(db);
 
 	return 0;
 }
 
+int db_load(struct DB *db, char *db_name, size_t cache_size) {
+	return dbi_load(db, db_name, cache_size, NULL);
+}
+
 /**
  * @brief    Free DB object
  *
@@ -121,6 +184,7 @@ int db_free(struct DB *db) {
 			free(db->top);
 			db->top = NULL;
 		}
+		warm_free(db);
 		dumper_free(db->pool);
 		if (db->pool) {
 			pool_free(db->pool);
@@ -140,15 +204,7 @@ int db_free(struct DB *db) {
  * @return Status
  */
 int db_search(struct DB *db, char *key, void **val, size_t *val_len) {
-	log_info("Searching value in the DB with key '%s'", key);
-	pageno_t ret = btreei_search(db, db->top, key, val_len);
-	if (ret == 0) return 0;
-	struct DataNode node;
-	node_data_load(db, &node, ret);
-	*val = strndup(node.data, node.h->size);
-	*val_len = node.h->size;
-	node_free(db, &node);
-	return 0;
+	return db_get(db, key, strlen(key), val, val_len);
 }
 
 /**
@@ -157,13 +213,11 @@ int db_search(struct DB *db, char *key, void **val, size_t *val_len) {
  * @return Status
  */
 int db_insert(struct DB *db, char *key, char *val, int val_len) {
-	log_info("Inserting value into DB with key '%s'", key);
-	return btreei_insert(db, db->top, key, val, val_len);
+	return db_put(db, key, strlen(key), val, val_len);
 }
 
 int db_delete(struct DB *db, char *key) {
-	log_info("Deleting value from DB with key '%s'", key);
-	return btreei_delete(db, db->top, key);
+	return db_del(db, key, strlen(key));
 }
 
 /* ######################## DEBUG ######################## */
@@ -174,16 +228,27 @@ int node_print(struct BTreeNode *node) {
 	printf("Size: %d, Flags: ", node->h->size);
 	if (node->h->flags & IS_LEAF) printf("IS_LEAF");
 	printf("\n");
+	if (node->h->flags & IS_LEAF)
+		printf("Prev: %zd, Next: %zd\n", node->h->prev, node->h->next);
 	printf("LSN: %zd\n", node->h->lsn);
 	int i = 0;
 	for (i = 0; i < node->h->size; ++i) {
-		printf("Key: %s, Value: %zd", NODE_KEY_POS(node, i), node->vals[i]);
+		printf("Key: %.*s, ", NODE_KEY_LEN(node, i), NODE_KEY_POS(node, i));
+		if (NODE_INLINE(node, i))
+			printf("Inline: %zd bytes", NODE_VAL(node, i));
+		else if (NODE_BLOB(node, i))
+			printf("Blob: %zd", NODE_VAL(node, i));
+		else if (NODE_PACKED(node, i))
+			printf("Packed: %zd/%zd", PACK_PAGE(NODE_VAL(node, i)),
+			       PACK_SLOT(NODE_VAL(node, i)));
+		else
+			printf("Value: %zd", NODE_VAL(node, i));
 		if (!(node->h->flags & IS_LEAF))
-			printf(", Child: %zd", node->chld[i]);
+			printf(", Child: %zd", NODE_CHLD(node, i));
 		printf("\n");
 	}
 	if (!(node->h->flags & IS_LEAF))
-		printf("Last Child: %zd\n", node->chld[node->h->size]);
+		printf("Last Child: %zd\n", NODE_CHLD(node, node->h->size));
 	printf("--------------------------------------\n");
 #endif
 	return 0;
@@ -195,9 +260,9 @@ int print_tree(struct DB *db, struct BTreeNode *node) {
 		return 0;
 	int i = 0;
 	for (i = 0; i < node->h->size + 1; ++i) {
-		assert(node->chld[i] != 0);
+		assert(NODE_CHLD(node, i) != 0);
 		struct BTreeNode n;
-		node_btree_load(db, &n, node->chld[i]);
+		node_btree_load(db, &n, NODE_CHLD(node, i));
 		print_tree(db, &n);
 		node_free(db, &n);
 	}
@@ -217,17 +282,172 @@ void db_close(struct DB *db) {
 }
 
 int db_del(struct DB *db, void *key, size_t key_len) {
-	return 0;
+	log_info("Deleting value from DB with key '%.*s'", (int )key_len, (char *)key);
+	check(key_len <= BTREE_KEY_LEN, "Key is too long (%zd)", key_len);
+	return btreei_delete(db, db->top, key, key_len);
+error:
+	return -1;
 }
 
+/**
+ * @brief      Build empty DB from the stream of sorted pairs
+ *
+ * @param db   DB object (mustn't contain any keys)
+ * @param next Source of pairs (keys must come in strictly increasing order)
+ * @param arg  Argument for next
+ * @param fill Percent of node space to fill (0 for BTREE_BULK_FILL)
+ *
+ * @return     Status
+ */
+int db_bulk_load(struct DB *db, db_bulk_next_t next, void *arg, int fill) {
+	log_info("Bulk loading DB %s", db->db_name);
+	if (fill <= 0) fill = BTREE_BULK_FILL;
+	if (fill > 100) fill = 100;
+	/* Pages are written bypassing the cache, prewarm mustn't read them */
+	warm_wait(db);
+	return btreei_bulk_load(db, next, arg, fill);
+}
+
+/**
+ * @brief    Compact DB in place: live pages are moved to the start of the
+ *           pool (in the order of keys, leaves next to their data pages),
+ *           empty tail of the file is cut off. DB stays open, but nothing
+ *           else may call into it until vacuum returns (there's no lock
+ *           to wait on). Open cursors and pinned values become invalid.
+ *
+ * @param db DB object
+ *
+ * @return   Status
+ */
+int db_vacuum(struct DB *db) {
+	log_info("Vacuuming DB %s", db->db_name);
+	/* Tail of the pool mustn't be cut off under the prewarm */
+	warm_wait(db);
+	return btreei_vacuum(db);
+}
+
+/**
+ * @brief         Open cursor at the first key, that isn't less than given
+ *                one (at the first key of DB, if key is NULL)
+ *
+ * @param[in]  db  DB object
+ * @param[out] cur Cursor to open (must be closed, if it was opened before)
+ *
+ * @return        Status (-1 if there's no such key)
+ */
+int db_cursor_seek(struct DB *db, struct DBCursor *cur,
+		   void *key, size_t key_len) {
+	check(key_len <= BTREE_KEY_LEN, "Key is too long (%zd)", key_len);
+	return btreei_cursor_seek(db, cur, key, key_len);
+error:
+	return -1;
+}
+
+int db_cursor_next(struct DBCursor *cur) {
+	return btreei_cursor_next(cur);
+}
+
+int db_cursor_prev(struct DBCursor *cur) {
+	return btreei_cursor_prev(cur);
+}
+
+int db_cursor_get(struct DBCursor *cur, void **key, size_t *key_len,
+		  void **val, size_t *val_len) {
+	return btreei_cursor_get(cur, key, key_len, val, val_len);
+}
+
+void db_cursor_close(struct DBCursor *cur) {
+	btreei_cursor_close(cur);
+}
+
+/**
+ * @brief  Get copy of the value. Lookups (db_get, db_get_many and
+ *         db_get_pinned) may run in many threads at once, as long as
+ *         nothing changes the DB meanwhile (see struct CacheBase).
+ *
+ * @return Status
+ */
 int db_get(struct DB *db, void *key, size_t key_len,
 	   void **val, size_t *val_len) {
-	return db_search(db, key, val, val_len);
+	log_info("Searching value in the DB with key '%.*s'", (int )key_len, (char *)key);
+	check(key_len <= BTREE_KEY_LEN, "Key is too long (%zd)", key_len);
+	btreei_search(db, db->top, key, key_len, val, val_len);
+	return 0;
+error:
+	return -1;
+}
+
+/**
+ * @brief         Search value without copying it
+ *
+ * @param[out] pin Value (pin->val is NULL, if key isn't found), must be
+ *                 released by db_release_pinned
+ *
+ * @return         Status
+ */
+int db_get_pinned(struct DB *db, void *key, size_t key_len,
+		  struct DBPin *pin) {
+	log_info("Searching value in the DB with key '%.*s'", (int )key_len, (char *)key);
+	check(key_len <= BTREE_KEY_LEN, "Key is too long (%zd)", key_len);
+	btreei_search_pinned(db, db->top, key, key_len, pin);
+	return 0;
+error:
+	return -1;
+}
+
+/**
+ * @brief       Search values of many keys in one walk of the tree: pages,
+ *              needed by the keys, are read ahead, when their parent is
+ *              visited. Values are copied into newly allocated memory
+ *              (items[i].val is NULL, if key isn't found).
+ *
+ * @return      Status
+ */
+int db_get_many(struct DB *db, struct DBItem *items, size_t count) {
+	log_info("Searching %zd values in the DB", count);
+	size_t i = 0;
+	for (i = 0; i < count; ++i)
+		check(items[i].key_len <= BTREE_KEY_LEN,
+		      "Key is too long (%zd)", items[i].key_len);
+	if (count == 0)
+		return 0;
+	return btreei_search_many(db, db->top, items, count);
+error:
+	return -1;
+}
+
+void db_release_pinned(struct DBPin *pin) {
+	btreei_search_release(pin);
 }
 
 int db_put(struct DB *db, void *key, size_t key_len,
 	   void *val, size_t val_len) {
-	return db_insert(db, key, val, val_len);
+	log_info("Inserting value into DB with key '%.*s'", (int )key_len, (char *)key);
+	check(key_len <= BTREE_KEY_LEN, "Key is too long (%zd)", key_len);
+	return btreei_insert(db, db->top, key, key_len, val, val_len);
+error:
+	return -1;
+}
+
+/**
+ * @brief       Insert batch of pairs: items are sorted, pairs, that land
+ *              in the same leaf, are inserted under one descent, whole batch
+ *              is logged as one WAL record group. If key repeats in the
+ *              batch, the last item wins.
+ *
+ * @return      Status
+ */
+int db_put_batch(struct DB *db, struct DBItem *items, size_t count) {
+	log_info("Inserting batch of %zd values into DB", count);
+	size_t i = 0;
+	for (i = 0; i < count; ++i)
+		check(items[i].key_len <= BTREE_KEY_LEN,
+		      "Key is too long (%zd)", items[i].key_len);
+	if (count == 0)
+		return 0;
+	return btreei_insert_batch(db, db->top, items, count);
+error:
+	return -1;
 }
 
 struct DB *dbcreate(char *file, struct DBC *config) {
@@ -236,9 +456,18 @@ struct DB *dbcreate(char *file, struct DBC *config) {
 	int dbmeta_exists = meta_check(file);
 	if (db_exists == 0) {
 		check(dbmeta_exists == 0, "No metafile exists, but DB exists. Exiting");
-		db_load(db, file, config->cache_size);
+		dbi_load(db, file, config->cache_size, config);
 	} else {
-		db_init(db, file, config->page_size, config->pool_size, config->cache_size);
+		size_t grow = (config->pool_grow ? config->pool_grow : POOL_GROW);
+		dbi_create(db, file, config->page_size, config->pool_size, grow,
+			   config->cache_size, config);
+		if (config->inline_max) {
+			db->inline_max = btree_inline_max(db, config->inline_max);
+			struct Metadata md = {config->pool_size, config->page_size,
+					      db->top->h->page, db->inline_max,
+					      grow, db->compress};
+			meta_dump(file, &md);
+		}
 	}
 	return db;
 error:
@@ -6,14 +6,50 @@
 #include <stdint.h>
 #include <pthread.h>
 
+/* Maximum length of key */
 #define BTREE_KEY_LEN 128
+/* Default maximum length of value, stored inside of BTree node */
+#define BTREE_INLINE_MAX 64
+/* Default percent of node space, filled by bulk load */
+#define BTREE_BULK_FILL 90
+/* Levels of the free page (empty extent) index (64^(levels + 1) pages are
+ * indexed in O(1)) */
+#define POOL_SUMMARY_LEVELS 5
+/* Group of adjacent pages, kept for neighbours (must divide 64) */
+#define POOL_EXTENT 16
+/* Default size of the chunk, pool file grows by (0 - whole pool at once) */
+#define POOL_GROW (4*1024*1024)
 
-#define NODE_KEY_POS(NODE, POS)  (NODE->keys + (POS) * BTREE_KEY_LEN)
-#define NODE_CHLD_POS(NODE, POS) (NODE->chld + (POS))
-#define NODE_VAL_POS(NODE, POS)  (NODE->vals + (POS))
+#define NODE_SLOT(NODE, POS)     ((NODE)->slots + (POS))
+#define NODE_REC(NODE, POS)      ((struct NodeRecord *)((char *)(NODE)->h + \
+					NODE_SLOT(NODE, POS)->off))
+#define NODE_KEY_POS(NODE, POS)  (NODE_REC(NODE, POS)->key)
+#define NODE_KEY_LEN(NODE, POS)  (NODE_SLOT(NODE, POS)->len & SLOT_LEN_MASK)
+#define NODE_VAL(NODE, POS)      (NODE_REC(NODE, POS)->val)
+/* Value is stored in the record right after the key, NODE_VAL is it's length */
+#define NODE_INLINE(NODE, POS)   (NODE_SLOT(NODE, POS)->len & SLOT_INLINE)
+#define NODE_INLINE_VAL(NODE, POS) (NODE_KEY_POS(NODE, POS) + NODE_KEY_LEN(NODE, POS))
+/* Value is stored in the blob store, NODE_VAL is it's first page */
+#define NODE_BLOB(NODE, POS)     (NODE_SLOT(NODE, POS)->len & SLOT_BLOB)
+/* Value is packed into the shared data page, NODE_VAL is PACK_REF of it */
+#define NODE_PACKED(NODE, POS)   (NODE_SLOT(NODE, POS)->len & SLOT_PACKED)
+/* Where the value, that isn't inline, is stored (SLOT_BLOB or SLOT_PACKED) */
+#define NODE_VFLAGS(NODE, POS)   (NODE_SLOT(NODE, POS)->len & (SLOT_BLOB | SLOT_PACKED))
+/* Length of key and inline value in the record */
+#define NODE_REC_LEN(NODE, POS)  (NODE_KEY_LEN(NODE, POS) +                   \
+				  (NODE_INLINE(NODE, POS) ? NODE_VAL(NODE, POS) : 0))
+#define NODE_CHLD(NODE, POS)     (*((POS) == 0 ? (NODE)->chld :       \
+					 &NODE_REC(NODE, (POS) - 1)->chld))
 
-#define NODE_FULL(DB, NODE) (NODE->h->size == DB->btree_degree)
-#define NODE_HALF(DB)       floor(DB->btree_degree/2)
+/* Heap records are aligned to 8 bytes */
+#define NODE_HEAP_END(PAGE_SIZE) ((PAGE_SIZE) & ~7)
+#define NODE_REC_SIZE(LEN)   ((sizeof(struct NodeRecord) + (LEN) + 7) & ~7)
+/* Space, needed for one key (with it's slot) in the node */
+#define NODE_ENTRY_SIZE(LEN) (sizeof(struct NodeSlot) + NODE_REC_SIZE(LEN))
+#define NODE_ENTRY_MAX(DB)   NODE_ENTRY_SIZE(BTREE_KEY_LEN + (DB)->inline_max)
+
+#define NODE_FULL(DB, NODE) (node_btree_free(DB, NODE) < NODE_ENTRY_MAX(DB))
+#define NODE_HALF(DB)       (((DB)->node_capacity - NODE_ENTRY_MAX(DB)) / 2)
 
 typedef ssize_t pageno_t;
 
@@ -21,23 +57,39 @@ enum NodeFlags {
 	IS_LEAF = 0x01,
 	IS_TOP  = 0x02,
 	IS_DATA = 0x04,
-/*	____RES = 0x08,*/
-/*	____RES = 0x10,*/
+	IS_BLOB = 0x08,
+	IS_PACKED = 0x10,
 /*	____RES = 0x20,*/
 /*	____RES = 0x40,*/
 /*	____RES = 0x80,*/
 };
 
+/*
+ * Index over the bitmap of free pages or empty extents (see pagepool.c)
+ */
+struct PoolIndex {
+	uint64_t *level[POOL_SUMMARY_LEVELS + 1]; /* level[0] is the bitmap itself
+						    * (the bitmask for pages) */
+	size_t    levels;
+};
+
 /**
  * @brief Structure for working with on-disk page pool
  */
 struct PagePool {
 	int                  fd;
 	uint16_t             page_size;
-	size_t               pool_size;
-	pageno_t             nPages;
+	size_t               pool_size; /* Maximum size, bitmask is reserved for */
+	pageno_t             nPages;    /* Pages in the file now */
+	pageno_t             maxPages;
+	pageno_t             grow;      /* Pages, file grows by */
 	void                *bitmask;
-	struct bit_iterator *it;
+	uint8_t             *bitmask_dirty; /* Bitmask pages, not flushed yet */
+	struct PoolIndex     pages;   /* Free page index */
+	struct PoolIndex     extents; /* Empty extent index */
+	pageno_t             extent; /* First page of the spill extent */
+	void                *map;    /* Mapped pool file (NULL - pread/pwrite) */
+	int                  dfd;    /* Pool file, opened with O_DIRECT (0 - none) */
 	struct CacheBase    *cache;
 	pthread_t            dumper;
 	int 		     dumper_enable;
@@ -47,14 +99,51 @@ struct NodeHeader {
 	pageno_t page;
 	uint8_t  flags;
 	uint32_t size;
+	uint16_t heap; /* Offset of the key heap start in the page */
+	uint16_t frag; /* Bytes in the key heap, freed by removed keys */
 	size_t   lsn;
+	pageno_t next; /* Right sibling of the leaf (0 for the last one) */
+	pageno_t prev; /* Left sibling of the leaf (0 for the first one) */
+};
+
+/*
+ * Slotted BTree page:
+ *
+ * |NodeHeader|chld0|slot 0|...|slot N| --> free <-- |rec N|...|rec 0|
+ *                                                   ^
+ *                                                   h->heap
+ *
+ * Slots are kept dense (8 bytes each), so search runs over them first:
+ * every slot holds first 4 bytes of the key (big-endian, zero padded),
+ * and the full key is read only when these heads are equal.
+ * Records are variable-length and live in the heap at the end of the page,
+ * every record holds child to the right of the key, value and the key.
+ *
+ * Tree is a B+tree: keys with values live in leaves only, leaves of the
+ * same level are linked with h->next/h->prev. Internal nodes hold
+ * separators (without values): child i keeps keys from key i-1
+ * (inclusive) up to key i.
+ */
+struct NodeSlot {
+	uint32_t head;
+	uint16_t off;
+	uint16_t len;
+#define SLOT_LEN_MASK 0x1FFF
+#define SLOT_PACKED   0x2000
+#define SLOT_BLOB     0x4000
+#define SLOT_INLINE   0x8000
+};
+
+struct NodeRecord {
+	pageno_t chld;
+	pageno_t val;   /* Data page or length of the inline value */
+	char     key[]; /* Key, followed by the inline value */
 };
 
 struct BTreeNode {
 	struct NodeHeader *h;
-	pageno_t *chld;
-	pageno_t *vals;
-	char     *keys;
+	pageno_t          *chld;
+	struct NodeSlot   *slots;
 };
 
 struct DataNode {
@@ -62,21 +151,145 @@ struct DataNode {
 	char  *data;
 };
 
+/*
+ * Values, that don't fit into one DataNode page, are stored as a chain of
+ * extents (runs of adjacent pages), bypassing the cache:
+ *
+ * |BlobHeader|part of value ........................|  -> next extent
+ * |<-------------------- count pages -------------->|
+ *
+ * h.size is the length of the part in this extent, next_size is the
+ * length of the part in the next one, so every extent is read by one
+ * vectored read together with its header.
+ */
+struct BlobHeader {
+	struct NodeHeader h;
+	pageno_t count;     /* Pages in this extent */
+	pageno_t next;      /* First page of the next extent (0 for the last) */
+	uint32_t next_size;
+	uint64_t total;     /* Length of the whole value */
+};
+
+/*
+ * Values, much smaller than a page, are packed (compressed, if it makes
+ * them shorter) into shared data pages, flagged IS_DATA | IS_PACKED:
+ *
+ * |NodeHeader|slot 0|...|slot N| --> free <-- |val N|...|val 0|
+ *                                             ^
+ *                                             h->heap
+ *
+ * h->size is the number of slots, h->frag - bytes of the freed values.
+ * Freed slot has len 0 and is reused, page is freed with the last value.
+ * Value is referenced by the page and the slot (see PACK_REF).
+ */
+struct PackSlot {
+	uint16_t off;
+	uint16_t len; /* Stored length (0 for the free slot) */
+	uint32_t raw; /* Length of the value (len, if it isn't compressed) */
+};
+
+#define PACK_SLOTS_MAX       256
+#define PACK_REF(PAGE, SLOT) (((PAGE) << 8) | (SLOT))
+#define PACK_PAGE(REF)       ((REF) >> 8)
+#define PACK_SLOT(REF)       ((REF) & 0xFF)
+
 struct DB {
 	char             *db_name;
 	struct PagePool  *pool;
 	struct BTreeNode *top;
 	struct WAL       *wal;
 	size_t            lsn;
-	pageno_t          btree_degree;
+	uint32_t          node_capacity;
+	uint32_t          inline_max;
+	uint32_t          compress; /* Values are packed and compressed */
+	pageno_t          pack;     /* Data page, values are packed into now */
+	pthread_t         warmer;   /* Prewarms cache and saves it's warm set */
+	int               warm_enable;
+	int               warming;  /* Cache isn't prewarmed yet */
+	pthread_mutex_t   warm_lock;
+	pthread_cond_t    warm_signal;
+};
+
+/*
+ * Value, returned by db_get_pinned. It points into the cached page, which
+ * stays pinned until db_release_pinned (values from the blob store are
+ * copied, as they bypass the cache). Value isn't NUL-terminated.
+ */
+struct DBPin {
+	struct DB *db;
+	pageno_t   page; /* Pinned page (0 if val is a private copy) */
+	void      *val;
+	size_t     val_len;
+};
+
+/*
+ * Cursor over keys in order. It pins (holds in the cache) only the leaf
+ * it points to. Any change of the DB invalidates open cursors.
+ */
+struct DBCursor {
+	struct DB        *db;
+	struct BTreeNode  leaf; /* leaf.h is NULL, if cursor points nowhere */
+	size_t            pos;
+};
+
+/*
+ * Pair for db_put_batch and db_get_many
+ */
+struct DBItem {
+	void   *key;
+	size_t  key_len;
+	void   *val;
+	size_t  val_len;
 };
 
 struct DBC {
 	size_t pool_size;
 	size_t page_size;
 	size_t cache_size;
+	size_t inline_max;
+	size_t pool_grow; /* 0 - POOL_GROW */
+	int    use_mmap;  /* Map pool file instead of pread/pwrite */
+	int    use_direct; /* Bypass the kernel page cache (O_DIRECT) */
+	int    compress;  /* Pack and compress values (see struct PackSlot) */
+	const struct CachePolicy *cache_policy; /* NULL - CLOCK (see cache.h) */
 };
 
+int  db_init  (struct DB *db, char *db_name, uint16_t page_size,
+	       pageno_t pool_size, size_t cache_size);
+int  db_load  (struct DB *db, char *db_name, size_t cache_size);
+int  db_free  (struct DB *db);
+void db_close (struct DB *db);
+int  db_get   (struct DB *db, void *key, size_t key_len,
+	       void **val, size_t *val_len);
+int  db_put   (struct DB *db, void *key, size_t key_len,
+	       void *val, size_t val_len);
+int  db_del   (struct DB *db, void *key, size_t key_len);
+int  db_put_batch(struct DB *db, struct DBItem *items, size_t count);
+int  db_get_many (struct DB *db, struct DBItem *items, size_t count);
+int  db_get_pinned    (struct DB *db, void *key, size_t key_len,
+		       struct DBPin *pin);
+void db_release_pinned(struct DBPin *pin);
+
+/*
+ * Source of pairs for db_bulk_load: returns 0 and the next pair, or -1
+ * when there're no more pairs. Pair must stay valid until the next call.
+ */
+typedef int (*db_bulk_next_t)(void *arg, void **key, size_t *key_len,
+			      void **val, size_t *val_len);
+int  db_bulk_load(struct DB *db, db_bulk_next_t next, void *arg, int fill);
+int  db_vacuum   (struct DB *db);
+
+int  db_cursor_seek (struct DB *db, struct DBCursor *cur,
+		     void *key, size_t key_len);
+int  db_cursor_next (struct DBCursor *cur);
+int  db_cursor_prev (struct DBCursor *cur);
+int  db_cursor_get  (struct DBCursor *cur, void **key, size_t *key_len,
+		     void **val, size_t *val_len);
+void db_cursor_close(struct DBCursor *cur);
+struct DB *dbcreate(char *file, struct DBC *config);
+
+uint32_t data_node_max_capacity(struct DB *db);
+
 /*
 void *node_header_init(struct DB *, struct BTreeNode *, void *);
 int node_btree_load   (struct DB *, struct BTreeNode *, pageno_t);
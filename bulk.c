@@ -0,0 +1,320 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "node.h"
+#include "blob.h"
+#include "btree.h"
+#include "bulk.h"
+#include "cache.h"
+#include "pagepool.h"
+#include "wal.h"
+
+/*
+ * Bottom-up bulk load: sorted pairs are packed into leaves left to right,
+ * every finished node passes it's smallest key and page to the level above.
+ * Pages are taken from runs of adjacent pages and written straight to the
+ * pool (they aren't reachable until the top node is replaced), so the only
+ * WAL record is the new top node at the end. If load fails, all pages,
+ * taken so far, are freed again.
+ */
+
+#define BULK_LEVELS 32 /* Height limit of the built tree */
+#define BULK_RUN    64 /* Pages, reserved at once */
+
+struct BulkLevel {
+	struct BTreeNode node;
+	int              open;  /* Node has at least one child (or key) */
+	size_t           nodes; /* Nodes, written on this level */
+	size_t           first_len;
+	char             first[BTREE_KEY_LEN]; /* Smallest key of the node */
+};
+
+/*
+ * Pages, taken by loader, that are freed, if load fails
+ */
+struct BulkRun {
+	pageno_t page;
+	pageno_t count; /* 0 - page is the first page of the blob */
+};
+
+struct BulkLoader {
+	struct DB        *db;
+	size_t            limit;    /* Space of the node, filled by loader */
+	pageno_t          run;      /* Next free page of the reserved run */
+	pageno_t          run_left;
+	struct BulkRun   *runs;     /* Reserved runs and written blobs */
+	size_t            nruns;
+	size_t            maxruns;
+	size_t            levels;
+	struct BulkLevel  level[BULK_LEVELS];
+	size_t            last_len;
+	char              last[BTREE_KEY_LEN];
+};
+
+/*
+ * Remember run of pages (or blob), taken by loader
+ */
+static void btreei_bulk_taken(struct BulkLoader *bl, pageno_t page,
+			      pageno_t count) {
+	if (bl->nruns == bl->maxruns) {
+		bl->maxruns = (bl->maxruns ? bl->maxruns * 2 : 16);
+		bl->runs = realloc(bl->runs, bl->maxruns * sizeof(struct BulkRun));
+		check_mem(bl->runs, bl->maxruns * sizeof(struct BulkRun));
+	}
+	bl->runs[bl->nruns].page  = page;
+	bl->runs[bl->nruns].count = count;
+	bl->nruns++;
+	return;
+error:
+	exit(-1);
+}
+
+/*
+ * Free all pages, taken by loader (nodes and values, written so far, aren't
+ * reachable, because top node isn't replaced)
+ */
+static void btreei_bulk_undo(struct BulkLoader *bl) {
+	size_t i = 0;
+	for (i = 0; i < bl->nruns; ++i) {
+		if (bl->runs[i].count > 0)
+			pool_dealloc_run(bl->db->pool, bl->runs[i].page,
+					 bl->runs[i].count);
+		else
+			blob_free(bl->db, bl->runs[i].page);
+	}
+	bl->nruns    = 0;
+	bl->run_left = 0;
+}
+
+/*
+ * Take next page of the reserved run (reserving new run, if needed)
+ */
+static pageno_t btreei_bulk_page(struct BulkLoader *bl) {
+	struct PagePool *pp = bl->db->pool;
+	if (bl->run_left == 0) {
+		bl->run = pool_alloc_run(pp, BULK_RUN, &bl->run_left);
+		check(bl->run != 0, "No space for bulk load");
+		btreei_bulk_taken(bl, bl->run, bl->run_left);
+		pageno_t page = bl->run;
+		for (; page < bl->run + bl->run_left; ++page)
+			cache_page_drop(pp->cache, page);
+	}
+	bl->run_left--;
+	return bl->run++;
+error:
+	return 0;
+}
+
+/*
+ * Node may take one more entry of the given size
+ */
+static int btreei_bulk_fits(struct BulkLoader *bl, struct BTreeNode *node,
+			    size_t size) {
+	if (node_btree_free(bl->db, node) < size)
+		return 0;
+	return node->h->size == 0 ||
+	       node_btree_used(bl->db, node) + size <= bl->limit;
+}
+
+static int btreei_bulk_start(struct BulkLoader *bl, size_t l, pageno_t page,
+			     void *key, size_t key_len) {
+	struct BulkLevel *lv = &bl->level[l];
+	check(page != 0, "No space for bulk load");
+	node_btree_init(bl->db, &lv->node, lv->node.h, page);
+	if (l == 0) lv->node.h->flags |= IS_LEAF;
+	memcpy(lv->first, key, key_len);
+	lv->first_len = key_len;
+	lv->open = 1;
+	return 0;
+error:
+	return -1;
+}
+
+static int btreei_bulk_add_child(struct BulkLoader *bl, size_t l,
+				 void *key, size_t key_len, pageno_t page);
+
+/*
+ * Write node of level l and pass it to the level above
+ */
+static int btreei_bulk_flush(struct BulkLoader *bl, size_t l) {
+	struct BulkLevel *lv = &bl->level[l];
+	pool_write(bl->db->pool, lv->node.h, bl->db->pool->page_size,
+		   lv->node.h->page, 0);
+	lv->nodes++;
+	lv->open = 0;
+	return btreei_bulk_add_child(bl, l + 1, lv->first, lv->first_len,
+				     lv->node.h->page);
+}
+
+/*
+ * Add child page (with the smallest key of it's subtree) to the level l
+ */
+static int btreei_bulk_add_child(struct BulkLoader *bl, size_t l,
+				 void *key, size_t key_len, pageno_t page) {
+	if (l == bl->levels) {
+		check(l < BULK_LEVELS, "Tree is too high for bulk load");
+		bl->level[l].node.h = malloc(bl->db->pool->page_size);
+		check_mem(bl->level[l].node.h, (size_t )bl->db->pool->page_size);
+		bl->levels++;
+	}
+	struct BulkLevel *lv = &bl->level[l];
+	if (lv->open && !btreei_bulk_fits(bl, &lv->node, NODE_ENTRY_SIZE(key_len)))
+		if (btreei_bulk_flush(bl, l) == -1)
+			return -1;
+	if (!lv->open) {
+		if (btreei_bulk_start(bl, l, btreei_bulk_page(bl), key, key_len) == -1)
+			return -1;
+		NODE_CHLD(&lv->node, 0) = page;
+		return 0;
+	}
+	return node_btree_insert(bl->db, &lv->node, lv->node.h->size,
+				 key, key_len, 0, page);
+error:
+	return -1;
+}
+
+/*
+ * Store value, that isn't inlined, out of the leaf
+ */
+static int btreei_bulk_data(struct BulkLoader *bl, struct BTreeNode *leaf,
+			    size_t pos, void *val, size_t val_len) {
+	struct DB *db = bl->db;
+	pageno_t page = 0;
+	if (val_len > data_node_max_capacity(db)) {
+		if (blob_write(db, val, val_len, &page) == -1)
+			return -1;
+		btreei_bulk_taken(bl, page, 0);
+		return node_btree_set_val(db, leaf, pos, page, SLOT_BLOB, NULL, 0);
+	}
+	page = btreei_bulk_page(bl);
+	if (page == 0)
+		return -1;
+	char buf[db->pool->page_size];
+	struct DataNode dnode = {.h = (struct NodeHeader *)buf};
+	memset(buf, 0, db->pool->page_size);
+	dnode.data     = buf + sizeof(struct NodeHeader);
+	dnode.h->page  = page;
+	dnode.h->flags = IS_DATA;
+	dnode.h->size  = val_len;
+	memcpy(dnode.data, val, val_len);
+	pool_write(db->pool, buf, db->pool->page_size, page, 0);
+	return node_btree_set_val(db, leaf, pos, page, 0, NULL, 0);
+}
+
+static int btreei_bulk_add(struct BulkLoader *bl, void *key, size_t key_len,
+			   void *val, size_t val_len) {
+	struct DB *db = bl->db;
+	struct BulkLevel *lv = &bl->level[0];
+	int inl = (val_len <= db->inline_max);
+	size_t size = NODE_ENTRY_SIZE(key_len + (inl ? val_len : 0));
+	if (lv->open && !btreei_bulk_fits(bl, &lv->node, size)) {
+		/* Page of the next leaf is needed for the link */
+		pageno_t next = btreei_bulk_page(bl);
+		pageno_t prev = lv->node.h->page;
+		lv->node.h->next = next;
+		if (btreei_bulk_flush(bl, 0) == -1 ||
+		    btreei_bulk_start(bl, 0, next, key, key_len) == -1)
+			return -1;
+		lv->node.h->prev = prev;
+	} else if (!lv->open) {
+		if (btreei_bulk_start(bl, 0, btreei_bulk_page(bl), key, key_len) == -1)
+			return -1;
+	}
+	size_t pos = lv->node.h->size;
+	node_btree_insert(db, &lv->node, pos, key, key_len, 0, 0);
+	if (inl)
+		return node_btree_set_val(db, &lv->node, pos, 0, 0, val, val_len);
+	return btreei_bulk_data(bl, &lv->node, pos, val, val_len);
+}
+
+/*
+ * Write all unfinished nodes. The last node of the highest level becomes
+ * the top node.
+ */
+static int btreei_bulk_finish(struct BulkLoader *bl) {
+	struct DB *db = bl->db;
+	size_t l = 0;
+	for (l = 0; l < bl->levels; ++l) {
+		struct BulkLevel *lv = &bl->level[l];
+		if (!lv->open)
+			continue;
+		if (l + 1 < bl->levels || lv->nodes > 0) {
+			if (btreei_bulk_flush(bl, l) == -1)
+				return -1;
+			continue;
+		}
+		pageno_t top  = db->top->h->page;
+		pageno_t page = lv->node.h->page;
+		node_write(db, db->top);
+		memcpy(db->top->h, lv->node.h, db->pool->page_size);
+		db->top->h->page   = top;
+		db->top->h->flags |= IS_TOP;
+		pool_dealloc_run(db->pool, page, 1);
+		wal_write_begin(db, OP_BULK, NULL, 0, NULL, 0);
+		node_btree_dump(db, db->top);
+		wal_write_finish(db);
+	}
+	return 0;
+}
+
+/**
+ * @brief  Build B-Tree of the empty DB from sorted pairs
+ *
+ * @param next Source of pairs (in strictly increasing order of keys)
+ * @param arg  Argument for next
+ * @param fill Percent of the node space to fill
+ *
+ * @return Status
+ */
+int btreei_bulk_load(struct DB *db, db_bulk_next_t next, void *arg, int fill) {
+	if (!(db->top->h->flags & IS_LEAF) || db->top->h->size > 0) {
+		log_err("Bulk load needs an empty DB");
+		return -1;
+	}
+	struct BulkLoader *bl = calloc(1, sizeof(struct BulkLoader));
+	check_mem(bl, sizeof(struct BulkLoader));
+	int retval = -1;
+	bl->db     = db;
+	bl->limit  = db->node_capacity * (size_t )fill / 100;
+	bl->levels = 1;
+	bl->level[0].node.h = malloc(db->pool->page_size);
+	check_mem(bl->level[0].node.h, (size_t )db->pool->page_size);
+
+	void  *key = NULL, *val = NULL;
+	size_t key_len = 0, val_len = 0;
+	size_t count = 0;
+	while (next(arg, &key, &key_len, &val, &val_len) == 0) {
+		if (key_len > BTREE_KEY_LEN) {
+			log_err("Key is too long (%zd)", key_len);
+			goto out;
+		}
+		if (count > 0 && node_key_cmp_raw(bl->last, bl->last_len,
+						  key, key_len) >= 0) {
+			log_err("Keys aren't sorted (key %zd)", count);
+			goto out;
+		}
+		if (btreei_bulk_add(bl, key, key_len, val, val_len) == -1)
+			goto out;
+		memcpy(bl->last, key, key_len);
+		bl->last_len = key_len;
+		count++;
+	}
+	if (count > 0 && btreei_bulk_finish(bl) == -1)
+		goto out;
+	log_info("Bulk load of %zd keys is done", count);
+	retval = 0;
+out:
+	if (retval == -1)
+		btreei_bulk_undo(bl);
+	else if (bl->run_left > 0)
+		pool_dealloc_run(db->pool, bl->run, bl->run_left);
+	size_t l = 0;
+	for (l = 0; l < bl->levels; ++l)
+		free(bl->level[l].node.h);
+	free(bl->runs);
+	free(bl);
+	return retval;
+error:
+	exit(-1);
+}
@@ -0,0 +1,8 @@
+#ifndef _BTREE_BULK_H_
+#define _BTREE_BULK_H_
+
+#include "btree.h"
+
+int btreei_bulk_load(struct DB *db, db_bulk_next_t next, void *arg, int fill);
+
+#endif /* _BTREE_BULK_H_ */
@@ -1,6 +1,11 @@
+#define _GNU_SOURCE /* MAP_ANONYMOUS, MAP_HUGETLB, MADV_HUGEPAGE */
+
 #include <math.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "cache.h"
 #include "dbg.h"
@@ -8,63 +13,339 @@
 
 #include <utlist.h>
 
+/*
+ * Set up frame descriptor with page buffers
+ */
+static void cachei_page_init(struct CacheElem *elem, void *cache) {
+	elem->cache  = cache;
+	elem->before = NULL;
+	pthread_mutex_init(&elem->lock, NULL);
+	pthread_cond_init(&elem->rw_signal, NULL);
+	elem->next = elem->rq_next = elem->ring = elem->chain = NULL;
+	elem->lprev = elem->lnext = NULL;
+	elem->list = 0;
+}
+
+/*
+ * Frame is carved out of the arena (isn't freed by itself)
+ */
+static inline int cachei_page_arena(struct CacheBase *cache,
+				    struct CacheElem *elem) {
+	return elem >= cache->elems && elem < cache->elems + cache->arena_frames;
+}
+
+/*
+ * Frame, added past the arena (when all frames are busy)
+ */
 struct CacheElem *cachei_page_alloc(struct CacheBase *cache) {
 	struct CacheElem *elem = calloc(1, sizeof(struct CacheElem));
 	check_mem(elem, sizeof(struct CacheElem));
-	elem->cache = calloc(1, cache->pool->page_size);
-	elem->prev = calloc(1, cache->pool->page_size);
-	check_mem(elem->cache, cache->pool->page_size);
-	pthread_mutex_init(&elem->lock, NULL);
-	pthread_cond_init(&elem->rw_signal, NULL);
-	elem->next = elem->rq_next = NULL;
+	/* Frame is aligned, so page may be read into it with O_DIRECT */
+	cachei_page_init(elem, pool_page_alloc(cache->pool, 1));
 	return elem;
 error:
 	exit(-1);
 }
 
-int cachei_page_free(struct CacheElem *elem) {
+int cachei_page_free(struct CacheBase *cache, struct CacheElem *elem) {
 	pthread_mutex_destroy(&elem->lock);
 	pthread_cond_destroy(&elem->rw_signal);
+	free(elem->before);
+	elem->before = NULL;
+	if (cachei_page_arena(cache, elem))
+		return 0;
 	free(elem->cache);
-	free(elem->prev);
 	free(elem);
 	return 0;
 }
 
+/*
+ * Map anonymous arena of size bytes: hugetlb pages, if they're reserved,
+ * otherwise regular pages, which kernel is asked to back by transparent
+ * huge pages. Mapping is page aligned, so frames are good for O_DIRECT.
+ */
+static void *cachei_arena_map(struct CacheBase *cache, size_t *size) {
+	void *arena = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	size_t huge = (*size + CACHE_HUGEPAGE - 1) / CACHE_HUGEPAGE * CACHE_HUGEPAGE;
+	arena = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (arena != MAP_FAILED) {
+		log_info("Cache arena of %zd bytes is on hugetlb pages", huge);
+		*size = huge;
+		return arena;
+	}
+#endif
+	arena = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	check(arena != MAP_FAILED, "Can't map cache arena of %zd bytes", *size);
+#ifdef MADV_HUGEPAGE
+	madvise(arena, *size, MADV_HUGEPAGE);
+#endif
+	return arena;
+error:
+	exit(-1);
+}
+
+/*
+ * Split count frames, starting from first, into shards (see struct
+ * CacheBase): each shard gets the run of frames as it's ring and buckets
+ * for as many pages
+ */
+static void cachei_shard_init(struct CacheBase *cache, struct CacheElem *first,
+			      size_t count) {
+	size_t nshards = 1, i = 0;
+	while (nshards < CACHE_SHARDS && count / (nshards * 2) >= CACHE_SHARD_FRAMES)
+		nshards *= 2;
+	cache->shard_bits = 0;
+	while ((1UL << cache->shard_bits) < nshards)
+		cache->shard_bits++;
+	check(posix_memalign((void **)&cache->shards, CACHE_LINE,
+			     nshards * sizeof(struct CacheShard)) == 0,
+	      "Can't allocate %zd cache shards", nshards);
+	for (i = 0; i < nshards; ++i) {
+		struct CacheShard *shard = &cache->shards[i];
+		size_t from = count * i / nshards, to = count * (i + 1) / nshards;
+		size_t buckets = 1;
+		while (buckets < to - from)
+			buckets *= 2;
+		pthread_mutex_init(&shard->latch, NULL);
+		shard->buckets = calloc(buckets, sizeof(struct CacheElem *));
+		check_mem(shard->buckets, buckets * sizeof(struct CacheElem *));
+		shard->mask   = buckets - 1;
+		shard->frames = to - from;
+		shard->ring   = &first[from];
+		shard->policy = NULL;
+		for (; from < to; ++from)
+			first[from].ring = (from + 1 < to ? &first[from + 1] :
+					    shard->ring);
+	}
+	log_info("Cache page table has %zd shards", nshards);
+	return;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief  Initialize cache: all frames are carved out of one arena -
+ *         descriptors are the dense array, pages are the dense run of the
+ *         mapped arena. Before-images of changed pages are kept aside
+ *         (see cache_page_write). Page table is split into shards, each
+ *         with it's own latch (see struct CacheBase), so the cache may be
+ *         used by many threads.
+ *
+ * @return Status
+ */
 int cache_init(struct CacheBase *cache, struct PagePool *pool, size_t cache_size) {
-	pageno_t count = floor(((double)cache_size)/(pool->page_size*2));
+	size_t count = floor(((double)cache_size)/pool->page_size) + 1;
+	size_t i = 0;
 	cache->cache_size = cache_size;
-	cache->hash = NULL;
 	cache->pool = pool;
-	cache->list_tail = cache->list_head = cachei_page_alloc(cache);
-	struct CacheElem *elem = NULL;
-	while (count-- > 0) {
-		elem = cachei_page_alloc(cache);
-		elem->next = cache->list_tail;
-		cache->list_tail = elem;
+	cache->elems = calloc(count, sizeof(struct CacheElem));
+	check_mem(cache->elems, count * sizeof(struct CacheElem));
+	cache->arena_frames = count;
+	cache->arena_size = count * pool->page_size;
+	cache->arena = cachei_arena_map(cache, &cache->arena_size);
+	cache->spare = NULL;
+	char *pages = (char *)cache->arena;
+	for (i = 0; i < count; ++i) {
+		cachei_page_init(&cache->elems[i], pages + i * pool->page_size);
+		if (i > 0)
+			cache->elems[i - 1].next = &cache->elems[i];
 	}
+	cache->list_tail = &cache->elems[0];
+	cache->list_head = &cache->elems[count - 1];
+	cache->frames = count;
+	cachei_shard_init(cache, cache->elems, count);
+	cache->policy = NULL;
+	cache_policy(cache, &cache_policy_clock);
 	cache_print(cache);
+	cache->readq = cache->readq_tail = NULL;
 	pthread_mutex_init(&cache->readq_lock, NULL);
+	pthread_mutex_init(&cache->list_lock, NULL);
+	pthread_mutex_init(&cache->spare_lock, NULL);
 	return 0;
+error:
+	exit(-1);
 }
 
 int cache_free(struct CacheBase *cache) {
 	struct CacheElem *el1, *el2;
-	HASH_ITER(hh, cache->hash, el1, el2) {
-		HASH_DEL(cache->hash, el1);
+	size_t i = 0;
+	for (i = 0; i < (1UL << cache->shard_bits); ++i) {
+		cache->policy->free(&cache->shards[i]);
+		pthread_mutex_destroy(&cache->shards[i].latch);
+		free(cache->shards[i].buckets);
 	}
+	free(cache->shards);
+	cache->shards = NULL;
 	el1 = cache->list_tail;
 	while ((el2 = el1)) {
 		el1 = el2->next;
-		cachei_page_free(el2);
+		cachei_page_free(cache, el2);
+	}
+	void *buf = NULL;
+	while ((buf = cache->spare)) {
+		cache->spare = *(void **)buf;
+		free(buf);
 	}
+	munmap(cache->arena, cache->arena_size);
+	free(cache->elems);
+	cache->arena = NULL;
+	cache->elems = NULL;
+	cache->arena_frames = cache->arena_size = 0;
 	pthread_mutex_destroy(&cache->readq_lock);
+	pthread_mutex_destroy(&cache->list_lock);
+	pthread_mutex_destroy(&cache->spare_lock);
 	cache->list_tail = cache->list_head = NULL;
+	cache->frames = 0;
 	cache->pool = NULL;
-	cache->hash = NULL;
 	return 0;
 }
 
+/**
+ * Forget cached copy of the page: it's going to be written bypassing the
+ * cache, so the stale copy mustn't be dumped over it.
+ */
+int cache_page_drop(struct CacheBase *cache, pageno_t page) {
+	struct CacheShard *shard = cachei_shard(cache, page);
+	pthread_mutex_lock(&shard->latch);
+	struct CacheElem *elem = cachei_hash_find(shard, page);
+	if (elem == NULL) {
+		pthread_mutex_unlock(&shard->latch);
+		return 0;
+	}
+	pthread_mutex_lock(&elem->lock);
+	/* Write in flight would land over the new content */
+	while (elem->flag & CACHE_WRITE)
+		pthread_cond_wait(&elem->rw_signal, &elem->lock);
+	cachei_hash_del(shard, elem);
+	cache->policy->drop(shard, elem);
+	cachei_page_release(cache, elem);
+	cachei_flag_clear(elem, CACHE_USED | CACHE_DIRTY);
+	elem->pins  = 0;
+	pthread_mutex_unlock(&elem->lock);
+	pthread_mutex_unlock(&shard->latch);
+	return 0;
+}
+
+/**
+ * @brief  Switch replacement policy of the cache (see struct CachePolicy).
+ *         Cached pages are kept: they're given to the new policy, as if
+ *         they were read. Cache mustn't be used by other threads meanwhile.
+ *
+ * @return Status
+ */
+int cache_policy(struct CacheBase *cache, const struct CachePolicy *policy) {
+	size_t i = 0;
+	for (i = 0; i < (1UL << cache->shard_bits); ++i) {
+		struct CacheShard *shard = &cache->shards[i];
+		struct CacheElem  *elem  = shard->ring;
+		pthread_mutex_lock(&shard->latch);
+		if (cache->policy)
+			cache->policy->free(shard);
+		check(policy->init(shard) == 0, "Can't set up %s cache policy",
+		      policy->name);
+		do {
+			elem->lprev = elem->lnext = NULL;
+			elem->list  = 0;
+			if (cachei_hash_find(shard, elem->id) == elem)
+				policy->admit(shard, elem);
+			else
+				policy->add(shard, elem);
+		} while ((elem = elem->ring) != shard->ring);
+		pthread_mutex_unlock(&shard->latch);
+	}
+	cache->policy = policy;
+	log_info("Cache policy is %s", policy->name);
+	return 0;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief  Page is going to be changed: copy it's before-image for the WAL
+ *         record, unless it's copied already since the last record (see
+ *         cachei_page_release). Pages, that are only read, aren't copied.
+ *
+ * @return Status
+ */
+int cache_page_write(struct CacheBase *cache, pageno_t page) {
+	struct CacheElem *elem = cachei_page_find(cache, page);
+	if (elem == NULL || elem->before)
+		return 0;
+	pthread_mutex_lock(&cache->spare_lock);
+	void *buf = cache->spare;
+	if (buf)
+		cache->spare = *(void **)buf;
+	pthread_mutex_unlock(&cache->spare_lock);
+	if (buf == NULL) {
+		buf = malloc(cache->pool->page_size);
+		check_mem(buf, (size_t )cache->pool->page_size);
+	}
+	memcpy(buf, elem->cache, cache->pool->page_size);
+	elem->before = buf;
+	return 0;
+error:
+	exit(-1);
+}
+
+/**
+ * Return before-image of the frame to spare buffers (when it's logged or
+ * frame is given to another page)
+ */
+void cachei_page_release(struct CacheBase *cache, struct CacheElem *elem) {
+	if (elem->before == NULL)
+		return;
+	pthread_mutex_lock(&cache->spare_lock);
+	*(void **)elem->before = cache->spare;
+	cache->spare = elem->before;
+	pthread_mutex_unlock(&cache->spare_lock);
+	elem->before = NULL;
+}
+
+/*
+ * Page in the shard (latch is held) or NULL
+ */
+struct CacheElem *cachei_hash_find(struct CacheShard *shard, pageno_t page) {
+	struct CacheElem *elem =
+		shard->buckets[(cachei_hash(page) >> CACHE_SHARD_BITS) & shard->mask];
+	while (elem && elem->id != page)
+		elem = elem->chain;
+	return elem;
+}
+
+void cachei_hash_add(struct CacheShard *shard, struct CacheElem *elem) {
+	struct CacheElem **bucket =
+		&shard->buckets[(cachei_hash(elem->id) >> CACHE_SHARD_BITS) & shard->mask];
+	elem->chain = *bucket;
+	*bucket = elem;
+}
+
+/*
+ * Remove the frame from the shard (if it's there)
+ */
+void cachei_hash_del(struct CacheShard *shard, struct CacheElem *elem) {
+	struct CacheElem **link =
+		&shard->buckets[(cachei_hash(elem->id) >> CACHE_SHARD_BITS) & shard->mask];
+	while (*link && *link != elem)
+		link = &(*link)->chain;
+	if (*link)
+		*link = elem->chain;
+	elem->chain = NULL;
+}
+
+/**
+ * @brief  Cached page (or NULL), it's frame isn't pinned
+ */
+struct CacheElem *cachei_page_find(struct CacheBase *cache, pageno_t page) {
+	struct CacheShard *shard = cachei_shard(cache, page);
+	pthread_mutex_lock(&shard->latch);
+	struct CacheElem *elem = cachei_hash_find(shard, page);
+	pthread_mutex_unlock(&shard->latch);
+	return elem;
+}
+
 int cache_print(struct CacheBase *cache) {
 	int count_1 = 0; struct CacheElem *temp;
 	int count_2 = 0;
@@ -4,39 +4,119 @@
 #include "btree.h"
 #include "pagepool.h"
 
-#include <uthash.h>
-
 #include <pthread.h>
+#include <stdint.h>
+
+/* Size of the huge page, cache arena is rounded to, when it's on hugetlb */
+#define CACHE_HUGEPAGE (2*1024*1024)
+/* Most shards of the page table and least frames per shard. Shard is
+ * chosen by the low CACHE_SHARD_BITS of the page hash, bucket - by the rest */
+#define CACHE_SHARD_BITS   6
+#define CACHE_SHARDS       (1 << CACHE_SHARD_BITS)
+#define CACHE_SHARD_FRAMES 64
+#define CACHE_LINE         64
 
 struct CacheElem {
 	pageno_t id;
 	void *cache;
-	void *prev;
+	void *before; /* Page before the change, that isn't logged yet (or NULL) */
 	int flag;
+	int pins;  /* Number of holders of the page (CACHE_USED while > 0) */
 #define CACHE_USED  0x01
 #define CACHE_DIRTY 0x02
 #define CACHE_EMPTY 0x04
+#define CACHE_LOAD  0x08 /* Page is queued for reading by the dumper */
+#define CACHE_WRITE 0x10 /* Page is being written by the dumper */
+#define CACHE_REF   0x20 /* Page was got since it's cached (or since the
+			  * clock hand passed it) */
 	struct CacheElem *next;
-	UT_hash_handle hh;
+	struct CacheElem *ring;  /* Next frame of the shard (circular) */
+	struct CacheElem *chain; /* Next page of the shard bucket */
+	struct CacheElem *lprev; /* Links of the policy list, frame is in */
+	struct CacheElem *lnext;
+	int               list;  /* Policy list, frame is in */
 	pthread_mutex_t lock;
 	pthread_cond_t  rw_signal;
 	struct CacheElem *rq_next;
 };
 
 /*
- *  /LRU/
- *  list_tail (recently used)
- *  ||                           list_head (most unused)
- *  ||                                                ||
- *  \/                                                \/
- *  |----|----|----|----|----|----|----|----|----|----|
+ *  list_tail (first frame)                               list_head (last frame)
+ *  ||                                                                      ||
+ *  \/                                                                      \/
+ *  |----|----|----|----|----|----|----|----|----|----|----|----|----|----|
+ *  <-- shard 0 ring (circular) --><----- shard 1 ring (circular) ------>
+ *
+ * Frames never move in the list (dumper walks it at the same time). Page
+ * belongs to the shard by it's number (see cachei_shard) and is cached only
+ * in the frames of the shard. Frame for the new page is chosen by the
+ * replacement policy of the cache (see struct CachePolicy), which keeps
+ * it's own state for every shard.
+ *
+ * Shard latch guards it's buckets, ring, policy state and pins of it's
+ * frames, so threads, getting pages of different shards, don't meet at all.
+ * Flags of the frame (CacheElem.flag) aren't owned by any lock: they're
+ * changed under the latch, under elem->lock (dumper) and with no lock at
+ * all (node dumps), so they're changed atomically only (see cachei_flag_set
+ * and cachei_flag_clear).
+ */
+struct CacheShard {
+	pthread_mutex_t   latch;
+	struct CacheElem **buckets; /* Chains of cached pages */
+	size_t            mask;     /* Number of buckets - 1 */
+	struct CacheElem *ring;     /* Any frame of the shard */
+	size_t            frames;
+	void             *policy;   /* State of the replacement policy */
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ * Replacement policy: hooks are called with the shard latch held. Frame,
+ * that is used, dirty, read or written (see cachei_frame_busy), mustn't be
+ * given away by victim.
  */
+struct CachePolicy {
+	const char *name;
+	/* Set up and tear down state of the shard (shard->policy) */
+	int  (*init)  (struct CacheShard *shard);
+	void (*free)  (struct CacheShard *shard);
+	/* Empty frame joins the shard (on init and when the shard grows) */
+	void (*add)   (struct CacheShard *shard, struct CacheElem *elem);
+	/* Cached page is got again (CACHE_REF is set, if it was got before) */
+	void (*hit)   (struct CacheShard *shard, struct CacheElem *elem);
+	/* Frame, page is going to be read into (NULL if all frames are busy) */
+	struct CacheElem *(*victim)(struct CacheShard *shard, pageno_t page);
+	/* Page (elem->id) is read into the frame, given by victim */
+	void (*admit) (struct CacheShard *shard, struct CacheElem *elem);
+	/* Page is forgotten, frame is empty */
+	void (*drop)  (struct CacheShard *shard, struct CacheElem *elem);
+};
+
+/*
+ * CLOCK (second chance) - default, hit costs setting of the bit only.
+ * 2Q and ARC keep the history of evicted pages, so pages, that are got
+ * once (e.g. by the full scan), don't push out pages, that are got often.
+ */
+extern const struct CachePolicy cache_policy_clock;
+extern const struct CachePolicy cache_policy_2q;
+extern const struct CachePolicy cache_policy_arc;
+
 struct CacheBase {
 	struct PagePool *pool;
 	size_t cache_size;
-	struct CacheElem *list_tail; /* That's where the most popular are  */
-	struct CacheElem *list_head; /* That's where the least popular are */
-	struct CacheElem *hash;      /* HashTable for fast search of preloaded pages */
+	struct CacheElem *list_tail; /* The first frame */
+	struct CacheElem *list_head; /* The last frame */
+	size_t            frames;
+	pthread_mutex_t   list_lock; /* Adding of frames to the list */
+	struct CacheShard *shards;
+	size_t            shard_bits;
+	const struct CachePolicy *policy;
+	struct CacheElem *elems;     /* Frames of the arena (dense array) */
+	size_t            arena_frames;
+	void             *arena;     /* Pages of these frames */
+	size_t            arena_size;
+	void             *spare;     /* Free before-image buffers (linked by the
+				      * first word) */
+	pthread_mutex_t   spare_lock;
 	struct CacheElem *readq;
 	struct CacheElem *readq_tail;
 	pthread_mutex_t   readq_lock;
@@ -46,9 +126,55 @@ int               cache_init         (struct CacheBase *cache, struct PagePool *
 				      size_t cache_size);
 int               cache_free         (struct CacheBase *cache);
 int 		  cache_print	     (struct CacheBase *cache);
+int 		  cache_page_drop    (struct CacheBase *cache, pageno_t page);
+int 		  cache_page_write   (struct CacheBase *cache, pageno_t page);
+int 		  cache_policy       (struct CacheBase *cache,
+				      const struct CachePolicy *policy);
 
 struct CacheElem *cachei_page_alloc   (struct CacheBase *cache);
-int 		  cachei_page_free    (struct CacheElem *elem );
+struct CacheElem *cachei_page_find    (struct CacheBase *cache, pageno_t page);
+struct CacheElem *cachei_hash_find    (struct CacheShard *shard, pageno_t page);
+void		  cachei_hash_add     (struct CacheShard *shard,
+				       struct CacheElem *elem);
+void		  cachei_hash_del     (struct CacheShard *shard,
+				       struct CacheElem *elem);
+int 		  cachei_page_free    (struct CacheBase *cache,
+				       struct CacheElem *elem);
+void		  cachei_page_release (struct CacheBase *cache,
+				       struct CacheElem *elem);
+
+/*
+ * Frame can't be taken by another page
+ */
+static inline int cachei_frame_busy(struct CacheElem *elem) {
+	return __atomic_load_n(&elem->flag, __ATOMIC_ACQUIRE) &
+	       (CACHE_USED | CACHE_DIRTY | CACHE_LOAD | CACHE_WRITE);
+}
+
+/*
+ * Bits of the flag are set and cleared by threads, holding different locks
+ * (see struct CacheShard), so plain |= and &= would lose them
+ */
+static inline void cachei_flag_set(struct CacheElem *elem, int flag) {
+	__atomic_fetch_or(&elem->flag, flag, __ATOMIC_ACQ_REL);
+}
+
+static inline void cachei_flag_clear(struct CacheElem *elem, int flag) {
+	__atomic_fetch_and(&elem->flag, ~flag, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Fibonacci hashing: high bits of the product depend on all bits of the
+ * page number, so runs of pages are spread over shards and buckets
+ */
+static inline uint64_t cachei_hash(pageno_t page) {
+	return ((uint64_t )page * 0x9E3779B97F4A7C15ULL) >> 24;
+}
+
+static inline struct CacheShard *cachei_shard(struct CacheBase *cache,
+					      pageno_t page) {
+	return &cache->shards[cachei_hash(page) & ((1 << cache->shard_bits) - 1)];
+}
 
 #ifndef   LRU
 #  define   LRU
@@ -57,8 +183,11 @@ int 		  cachei_page_free    (struct CacheElem *elem );
 #ifdef    LRU
 #  include "lru.h"
 #  define  cache_page_get(cache, page)  lru_page_get(cache, page)
-#  define  cachei_page_get(cache, page) lrui_page_get(cache, page, 1)
+#  define  cachei_page_get(cache, page) lrui_page_get(cache, page, 0)
 #  define  cache_page_free(cache, page) lru_page_free(cache, page)
+#  define  cache_page_prefetch(cache, page) lru_page_prefetch(cache, page)
+#  define  cachei_page_claim(cache, page)  lrui_page_claim(cache, page)
+#  define  cachei_page_loaded(cache, elem) lrui_page_loaded(cache, elem)
 #endif /* LRU */
 
 #endif  /* _BTREE_CACHE_H_ */
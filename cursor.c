@@ -0,0 +1,121 @@
+#include <string.h>
+
+#include "dbg.h"
+#include "node.h"
+#include "btree.h"
+#include "search.h"
+#include "cursor.h"
+
+/*
+ * Return pinned leaf to the cache (top node is held by DB itself)
+ */
+static void btreei_cursor_unpin(struct DBCursor *cur) {
+	if (cur->leaf.h && cur->leaf.h != cur->db->top->h)
+		node_free(cur->db, &cur->leaf);
+	cur->leaf.h = NULL;
+}
+
+/*
+ * Move cursor to the leaf page, skipping empty leaves in the direction of
+ * movement. Cursor points to the first (last, if moving backward) key.
+ */
+static int btreei_cursor_enter(struct DBCursor *cur, pageno_t page,
+			       int forward) {
+	btreei_cursor_unpin(cur);
+	while (page) {
+		node_btree_load(cur->db, &cur->leaf, page);
+		if (cur->leaf.h->size > 0) {
+			cur->pos = (forward ? 0 : cur->leaf.h->size - 1);
+			return 0;
+		}
+		page = (forward ? cur->leaf.h->next : cur->leaf.h->prev);
+		btreei_cursor_unpin(cur);
+	}
+	return -1;
+}
+
+/**
+ * @brief  Position cursor at the first key, that isn't less than given one
+ *         (at the first key of DB, if key is NULL)
+ *
+ * @return Status (-1 if there's no such key)
+ */
+int btreei_cursor_seek(struct DB *db, struct DBCursor *cur,
+		       void *key, size_t key_len) {
+	cur->db  = db;
+	cur->pos = 0;
+	struct BTreeNode node = *db->top, kid;
+	while (!(node.h->flags & IS_LEAF)) {
+		size_t pos = (key ? node_key_child(&node, key, key_len) : 0);
+		node_btree_load(db, &kid, NODE_CHLD(&node, pos));
+		if (node.h != db->top->h)
+			node_free(db, &node);
+		node = kid;
+	}
+	cur->leaf = node;
+	if (key) {
+		int cmp = 0;
+		cur->pos = node_key_search(&node, key, key_len, &cmp);
+	}
+	if (cur->pos < node.h->size)
+		return 0;
+	return btreei_cursor_enter(cur, node.h->next, 1);
+}
+
+/**
+ * @brief  Move cursor to the next key
+ *
+ * @return Status (-1 if cursor went past the last key)
+ */
+int btreei_cursor_next(struct DBCursor *cur) {
+	if (!cur->leaf.h)
+		return -1;
+	if (++cur->pos < cur->leaf.h->size)
+		return 0;
+	return btreei_cursor_enter(cur, cur->leaf.h->next, 1);
+}
+
+/**
+ * @brief  Move cursor to the previous key
+ *
+ * @return Status (-1 if cursor went past the first key)
+ */
+int btreei_cursor_prev(struct DBCursor *cur) {
+	if (!cur->leaf.h)
+		return -1;
+	if (cur->pos > 0) {
+		--cur->pos;
+		return 0;
+	}
+	return btreei_cursor_enter(cur, cur->leaf.h->prev, 0);
+}
+
+/**
+ * @brief  Get key and value under cursor. Key points into the pinned leaf
+ *         and stays valid until cursor moves, value is copied into newly
+ *         allocated memory (it isn't read, if val is NULL).
+ *
+ * @return Status (-1 if cursor points nowhere)
+ */
+int btreei_cursor_get(struct DBCursor *cur, void **key, size_t *key_len,
+		      void **val, size_t *val_len) {
+	check(cur->leaf.h != NULL, "Cursor points nowhere");
+	if (key) {
+		*key     = NODE_KEY_POS(&cur->leaf, cur->pos);
+		*key_len = NODE_KEY_LEN(&cur->leaf, cur->pos);
+	}
+	if (val)
+		return btreei_search_value(cur->db, &cur->leaf, cur->pos,
+					   val, val_len);
+	return 0;
+error:
+	return -1;
+}
+
+/**
+ * @brief  Release leaf, pinned by cursor
+ */
+void btreei_cursor_close(struct DBCursor *cur) {
+	btreei_cursor_unpin(cur);
+	cur->pos = 0;
+}
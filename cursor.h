@@ -0,0 +1,14 @@
+#ifndef _BTREE_CURSOR_H_
+#define _BTREE_CURSOR_H_
+
+#include "btree.h"
+
+int  btreei_cursor_seek (struct DB *db, struct DBCursor *cur,
+			 void *key, size_t key_len);
+int  btreei_cursor_next (struct DBCursor *cur);
+int  btreei_cursor_prev (struct DBCursor *cur);
+int  btreei_cursor_get  (struct DBCursor *cur, void **key, size_t *key_len,
+			 void **val, size_t *val_len);
+void btreei_cursor_close(struct DBCursor *cur);
+
+#endif /* _BTREE_CURSOR_H_ */
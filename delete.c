@@ -2,196 +2,217 @@
 #include <math.h>
 #include <assert.h>
 
+#include "dbg.h"
 #include "node.h"
+#include "blob.h"
+#include "pack.h"
 #include "btree.h"
 #include "delete.h"
 #include "wal.h"
 
-static int btreei_delete_replace_max(struct DB *db, struct BTreeNode *node,
-		size_t pos, struct BTreeNode *left) {
-	struct BTreeNode *left_bkp = left;
-	struct BTreeNode  left_new;
-	while (!(left->h->flags & IS_LEAF)) {
-		node_btree_load(db, &left_new, left->chld[left->h->size]);
-		//if (left != left_bkp) free(left);
-		left = &left_new;
-	}
-	memcpy(NODE_KEY_POS(left, left->h->size-1), NODE_KEY_POS(node, pos), BTREE_KEY_LEN);
-	node->vals[pos] = left->vals[left->h->size-1];
-	node_btree_dump(db, left);
-	node_btree_dump(db, left_bkp);
-	return 0;
+#define NODE_RICH(DB, NODE) (node_btree_used(DB, NODE) > NODE_HALF(DB))
+
+/*
+ * Node may take key spos of src instead of key at position pos
+ */
+static int btreei_key_fits(struct DB *db, struct BTreeNode *node, size_t pos,
+			   struct BTreeNode *src, size_t spos) {
+	return node_btree_free(db, node) + NODE_ENTRY_SIZE(NODE_REC_LEN(node, pos)) >=
+	       NODE_ENTRY_SIZE(NODE_REC_LEN(src, spos));
 }
 
-static int btreei_delete_replace_min(struct DB *db, struct BTreeNode *node,
-		              size_t pos, struct BTreeNode *right) {
-	struct BTreeNode *right_bkp = right;
-	struct BTreeNode  right_new;
-	while (!(right->h->flags & IS_LEAF)) {
-		node_btree_load(db, &right_new, right->chld[0]);
-		//if (right != right_bkp) free(right);
-		right = &right_new;
-	}
-	memcpy(NODE_KEY_POS(right, 0), NODE_KEY_POS(node, pos), BTREE_KEY_LEN);
-	node->vals[pos] = right->vals[right->h->size-1];
-	node_btree_dump(db, right);
-	node_btree_dump(db, right_bkp);
-	return 0;
+/*
+ * Free data page of the key at position pos (if it has one)
+ */
+static void btreei_free_data(struct DB *db, struct BTreeNode *node, size_t pos) {
+	if (NODE_BLOB(node, pos))
+		blob_free(db, NODE_VAL(node, pos));
+	else if (NODE_PACKED(node, pos))
+		pack_free(db, NODE_VAL(node, pos));
+	else if (!NODE_INLINE(node, pos))
+		node_deallocate(db, NODE_VAL(node, pos));
 }
 
+/*
+ * Move all keys of right into left (with separator pos of the node, if
+ * they aren't leaves). Page of the right node is freed.
+ */
 static int btreei_merge_nodes(struct DB *db, struct BTreeNode *node, size_t pos,
-		       struct BTreeNode *left, struct BTreeNode *right) {
-	memcpy(NODE_KEY_POS(node, pos), NODE_KEY_POS(left, left->h->size), BTREE_KEY_LEN);
-	left->vals[left->h->size] = node->vals[pos];
-	memmove(NODE_KEY_POS(node, pos), NODE_KEY_POS(node, pos + 1),
-			BTREE_KEY_LEN * (node->h->size - pos - 1));
-	memmove(NODE_VAL_POS(node, pos), NODE_VAL_POS(node, pos + 1),
-			sizeof(size_t) * (node->h->size - pos - 1));
-	memmove(NODE_VAL_POS(node, pos + 1), NODE_VAL_POS(node, pos + 2),
-			sizeof(size_t) *(node->h->size - pos));
-	--node->h->size;
-	++left->h->size;
-	memcpy(NODE_KEY_POS(left, left->h->size), NODE_KEY_POS(right, 0),
-			BTREE_KEY_LEN * right->h->size);
-	memcpy(NODE_VAL_POS(left, left->h->size), NODE_VAL_POS(right, 0),
-			sizeof(size_t) * right->h->size);
-	memcpy(NODE_VAL_POS(left, left->h->size - 1), NODE_VAL_POS(right, 0),
-			sizeof(size_t) * right->h->size);
-	left->h->size += right->h->size;
-	right->h->size = 0;
+			      struct BTreeNode *left, struct BTreeNode *right) {
+	int isLeaf = left->h->flags & IS_LEAF;
+	size_t need = node_btree_used(db, right);
+	if (!isLeaf)
+		need += NODE_ENTRY_SIZE(NODE_REC_LEN(node, pos));
+	if (node_btree_free(db, left) < need)
+		return -1;
+	if (isLeaf) {
+		node_write(db, left);
+		left->h->next = right->h->next;
+		if (right->h->next) {
+			struct BTreeNode next;
+			node_btree_load(db, &next, right->h->next);
+			node_write(db, &next);
+			next.h->prev = left->h->page;
+			node_btree_dump(db, &next);
+			node_free(db, &next);
+		}
+	} else {
+		node_btree_copy(db, left, left->h->size, node, pos,
+				NODE_CHLD(right, 0));
+	}
+	node_btree_append(db, left, right, 0, right->h->size);
+	node_btree_remove(db, node, pos);
+	node_btree_truncate(db, right, 0);
+	node_deallocate(db, right->h->page);
+	node_btree_dump(db, left);
+	node_btree_dump(db, node);
 	return 0;
 }
 
 static int btreei_transfuse_to_left(struct DB *db, struct BTreeNode *node,
 		size_t pos, struct BTreeNode *to, struct BTreeNode *from) {
-	/*
-	 * node->pos_key -> append(to, key)
-	 * from->begin_key -> node->pos_key
-	 * from->begin_chld -> append(to, chld)
-	 * */
-	memcpy(NODE_KEY_POS(to, to->h->size), NODE_KEY_POS(node, pos),
-			BTREE_KEY_LEN);
-	to->vals[to->h->size] = node->vals[pos];
-	memcpy(NODE_KEY_POS(node, pos), NODE_KEY_POS(from, 0), BTREE_KEY_LEN);
-	node->vals[pos] = from->vals[0];
-	to->chld[to->h->size] = from->chld[0];
-	memcpy(NODE_KEY_POS(from, 0), NODE_KEY_POS(from, 1),
-			BTREE_KEY_LEN * (from->h->size - 1));
-	memcpy(NODE_VAL_POS(from, 0), NODE_VAL_POS(from, 1),
-			sizeof(size_t)* (from->h->size - 1));
-	memcpy(NODE_CHLD_POS(from, 0), NODE_CHLD_POS(from, 1),
-			sizeof(size_t)* (from->h->size - 1));
-	--from->h->size;
-	++to->h->size;
+	if (to->h->flags & IS_LEAF) {
+		/*
+		 * from->begin_key -> append(to, key)
+		 * from->second_key -> node->pos_key
+		 * */
+		if (from->h->size < 2 ||
+		    node_btree_set_key(db, node, pos, NODE_KEY_POS(from, 1),
+				       NODE_KEY_LEN(from, 1)) == -1)
+			return -1;
+		node_btree_copy(db, to, to->h->size, from, 0, 0);
+		node_btree_remove(db, from, 0);
+	} else {
+		/*
+		 * node->pos_key -> append(to, key)
+		 * from->begin_key -> node->pos_key
+		 * from->begin_chld -> append(to, chld)
+		 * */
+		if (!btreei_key_fits(db, node, pos, from, 0))
+			return -1;
+		node_btree_copy(db, to, to->h->size, node, pos, NODE_CHLD(from, 0));
+		node_btree_replace(db, node, pos, from, 0);
+		node_write(db, from);
+		NODE_CHLD(from, 0) = NODE_CHLD(from, 1);
+		node_btree_remove(db, from, 0);
+	}
+	node_btree_dump(db, to);
+	node_btree_dump(db, from);
+	node_btree_dump(db, node);
 	return 0;
 }
 
 static int btreei_transfuse_to_right(struct DB *db, struct BTreeNode *node,
 		size_t pos, struct BTreeNode *to, struct BTreeNode *from) {
-	/*
-	 * node->pos_key -> append(to, key)
-/	 * from->begin_key -> node->pos_key
-	 * from->begin_chld -> append(to, chld)
-	 * */
-	memcpy(NODE_KEY_POS(to, 1), NODE_KEY_POS(to, 0),
-			BTREE_KEY_LEN * to->h->size);
-	memcpy(NODE_VAL_POS(to, 1), NODE_VAL_POS(to, 0),
-			sizeof(size_t)* to->h->size);
-	memcpy(NODE_CHLD_POS(to, 1), NODE_CHLD_POS(to, 0),
-			sizeof(size_t)* to->h->size);
-	
-	memcpy(NODE_KEY_POS(to, 0), NODE_KEY_POS(node, pos),
-			BTREE_KEY_LEN);
-	to->vals[0] = node->vals[pos];
-	
-	memcpy(NODE_KEY_POS(node, pos), NODE_KEY_POS(from, from->h->size-1), BTREE_KEY_LEN);
-	node->vals[pos] = from->vals[from->h->size-1];
-	to->chld[0] = from->chld[from->h->size-1];
-	--from->h->size;
-	++to->h->size;
+	size_t last = from->h->size - 1;
+	if (to->h->flags & IS_LEAF) {
+		/*
+		 * from->end_key -> prepend(to, key)
+		 * from->end_key -> node->pos_key
+		 * */
+		if (from->h->size < 2 ||
+		    node_btree_set_key(db, node, pos, NODE_KEY_POS(from, last),
+				       NODE_KEY_LEN(from, last)) == -1)
+			return -1;
+		node_btree_copy(db, to, 0, from, last, 0);
+		node_btree_remove(db, from, last);
+	} else {
+		/*
+		 * node->pos_key -> prepend(to, key)
+		 * from->end_key -> node->pos_key
+		 * from->end_chld -> prepend(to, chld)
+		 * */
+		if (!btreei_key_fits(db, node, pos, from, last))
+			return -1;
+		node_btree_copy(db, to, 0, node, pos, NODE_CHLD(to, 0));
+		NODE_CHLD(to, 0) = NODE_CHLD(from, last + 1);
+		node_btree_replace(db, node, pos, from, last);
+		node_btree_remove(db, from, last);
+	}
+	node_btree_dump(db, to);
+	node_btree_dump(db, from);
+	node_btree_dump(db, node);
 	return 0;
 }
 
-int btreei_delete(struct DB *db, struct BTreeNode *node, void *key) {
-	wal_write_begin(db, OP_DELETE, key, strlen(key), NULL, 0);
-	int pos = 0;
-	int cmp = 0;
-	while (pos < node->h->size && ((cmp =
-			strncmp(NODE_KEY_POS(node, pos), key, BTREE_KEY_LEN)) < 0))
-		++pos;
-//	if (cmp < 0) --pos;
-	int isLeaf = node->h->flags & IS_LEAF;
-	if (isLeaf && pos < node->h->size && !cmp) {
-		memmove(NODE_KEY_POS(node, pos), NODE_KEY_POS(node, pos + 1),
-				BTREE_KEY_LEN * (node->h->size - pos - 1));
-		memmove(NODE_VAL_POS(node, pos), NODE_VAL_POS(node, pos + 1),
-				sizeof(size_t) * (node->h->size - pos - 1));
-	} else if (isLeaf && cmp) {
+/*
+ * Top node became empty after merge of it's only two children:
+ * move the only child into the top page (top page never changes)
+ */
+static void btreei_collapse_top(struct DB *db, struct BTreeNode *node,
+				struct BTreeNode *kid) {
+	pageno_t page = node->h->page;
+	node_write(db, node);
+	memcpy(node->h, kid->h, db->pool->page_size);
+	node->h->page   = page;
+	node->h->flags |= IS_TOP;
+	node_deallocate(db, kid->h->page);
+	node_btree_dump(db, node);
+}
+
+static int btreei_delete_key(struct DB *db, struct BTreeNode *node,
+			     void *key, size_t key_len) {
+	if (node->h->flags & IS_LEAF) {
+		int cmp = 0;
+		size_t pos = node_key_search(node, key, key_len, &cmp);
+		if (cmp)
+			return 0;
+		btreei_free_data(db, node, pos);
+		node_btree_remove(db, node, pos);
+		node_btree_dump(db, node);
 		return 0;
-	} else if (!isLeaf && !cmp) {
-		do {
-			struct BTreeNode kid_left, kid_right;
-			node_btree_load(db, &kid_left, node->chld[pos]);
-			if (kid_left.h->size > NODE_HALF(db)) {
-				btreei_delete_replace_max(db, node, pos, &kid_left);
-				btreei_delete(db, &kid_left, key);
-				//free(kid_left);
+	}
+	int retval = 0;
+	size_t pos = node_key_child(node, key, key_len);
+	struct BTreeNode kid, kid_left, kid_right;
+	node_btree_load(db, &kid, NODE_CHLD(node, pos));
+	if (!NODE_RICH(db, &kid)) do {
+		if (pos > 0) {
+			node_btree_load(db, &kid_left, NODE_CHLD(node, pos - 1));
+			int rich = NODE_RICH(db, &kid_left);
+			if (rich && btreei_transfuse_to_right(db, node, pos - 1,
+							      &kid, &kid_left) == 0) {
+				node_free(db, &kid_left);
 				break;
 			}
-			node_btree_load(db, &kid_right, node->chld[pos+1]);
-			if (kid_right.h->size > NODE_HALF(db)) {
-				btreei_delete_replace_min(db, node, pos, &kid_right);
-				btreei_delete(db, &kid_right, key);
-				//free(kid_left);
-				//free(kid_right);
+			if (!rich && btreei_merge_nodes(db, node, pos - 1,
+							&kid_left, &kid) == 0) {
+				node_free(db, &kid);
+				kid = kid_left;
 				break;
 			}
-//
-			/* TODO: May become empty*/
-			btreei_merge_nodes(db, node, pos, &kid_left, &kid_right);
-			node_deallocate(db, kid_right.h->page);
-			btreei_delete(db, &kid_left, key);
-			//free(kid_left);
-			//free(kid_right);
-		} while (0);
-	} else {
-		struct BTreeNode kid;
-		node_btree_load(db, &kid, node->chld[pos]);
-		if ((kid.h->size) <= NODE_HALF(db)) {
-			struct BTreeNode kid_left, kid_right;
-			do {
-				node_btree_load(db, &kid_left, node->chld[pos]);
-				if (kid_left.h->size > NODE_HALF(db)) {
-					btreei_transfuse_to_left(db, node, pos,
-							         &kid, &kid_left);
-					break;
-				}
-				node_btree_load(db, &kid_right, node->chld[pos+1]);
-				if (kid_right.h->size > NODE_HALF(db)) {
-					btreei_transfuse_to_right(db, node, pos,
-							          &kid, &kid_right);
-					// free(kid_right);
-					break;
-				}
-				btreei_merge_nodes(db, node, pos, &kid, &kid_right);
-				node_deallocate(db, kid_right.h->page);
-				btreei_delete(db, &kid_left, key);
-				// free(kid_right);
-			} while (0);
-			if (kid_left.h->size > NODE_HALF(db)) {
-			} else if (kid_right.h->size > NODE_HALF(db)) {
-				btreei_transfuse_to_right(db, node, pos, &kid, &kid_right);
-			} else {
-				btreei_merge_nodes(db, node, pos, &kid, &kid_right);
-				node_deallocate(db, kid_right.h->page);
-				btreei_delete(db, &kid_right, key);
+			node_free(db, &kid_left);
+		}
+		if (pos < node->h->size) {
+			node_btree_load(db, &kid_right, NODE_CHLD(node, pos + 1));
+			int rich = NODE_RICH(db, &kid_right);
+			if (rich && btreei_transfuse_to_left(db, node, pos,
+							     &kid, &kid_right) == 0) {
+				node_free(db, &kid_right);
+				break;
 			}
-			// free(kid_left);
-			// free(kid_right);
+			if (!rich && btreei_merge_nodes(db, node, pos,
+							&kid, &kid_right) == 0) {
+				node_free(db, &kid_right);
+				break;
+			}
+			node_free(db, &kid_right);
 		}
-		btreei_delete(db, &kid, key);
-		// free(kid);
+	} while (0);
+	if (node->h->size == 0 && (node->h->flags & IS_TOP)) {
+		btreei_collapse_top(db, node, &kid);
+		retval = btreei_delete_key(db, node, key, key_len);
+	} else {
+		retval = btreei_delete_key(db, &kid, key, key_len);
 	}
+	node_free(db, &kid);
+	return retval;
+}
+
+int btreei_delete(struct DB *db, struct BTreeNode *node,
+		  void *key, size_t key_len) {
+	wal_write_begin(db, OP_DELETE, key, key_len, NULL, 0);
+	int retval = btreei_delete_key(db, node, key, key_len);
 	wal_write_finish(db);
-	return 0;
+	return retval;
 }
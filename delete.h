@@ -1,6 +1,7 @@
 #ifndef _BTREE_DELETE_H_
 #define _BTREE_DELETE_H_
 
-int btreei_delete(struct DB *db, struct BTreeNode *node, void *key);
+int btreei_delete(struct DB *db, struct BTreeNode *node,
+		  void *key, size_t key_len);
 
 #endif /* _BTREE_DELETE_H_ */
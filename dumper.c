@@ -2,9 +2,31 @@
 
 #include "btree.h"
 #include "dbg.h"
+#include "uring.h"
 
 #include <pthread.h>
 #include <errno.h>
+#include <stdlib.h>
+
+#define DUMPER_DEPTH 64 /* Page reads and writes, kept in flight */
+
+/*
+ * Request in flight. Page is written from the copy, taken under the page
+ * lock, so the page may change meanwhile; read goes straight to the frame.
+ */
+struct DumperSlot {
+	struct CacheElem *elem;
+	void             *buf; /* Copy of the page (NULL for reads) */
+};
+
+struct DumperIO {
+	struct PagePool   *pp;
+	struct URing       ring;
+	struct DumperSlot  slot[DUMPER_DEPTH];
+	size_t             free[DUMPER_DEPTH]; /* Stack of free slots */
+	size_t             nfree;
+	void              *bufs;
+};
 
 static int dumperi_readq_check(struct CacheBase *cache) {
 	pthread_mutex_lock(&cache->readq_lock);
@@ -34,7 +56,7 @@ static int dumperi_readq_dequeue(struct CacheBase *cache) {
 	} else if (cache->readq->rq_next == NULL) {
 		cache->readq = cache->readq_tail = NULL;
 	} else {
-		cache->readq = cache->readq->next;
+		cache->readq = cache->readq->rq_next;
 		elem->rq_next = NULL;
 	}
 	pthread_mutex_unlock(&cache->readq_lock);
@@ -47,14 +69,116 @@ static int dumper_page_dump(struct CacheBase *cache, struct CacheElem *elem) {
 	return retval;
 }
 
+/*
+ * Page is read into the frame, wake up waiters (frame lock is held)
+ */
+static void dumper_page_loaded(struct CacheBase *cache, struct CacheElem *elem) {
+	cachei_flag_clear(elem, CACHE_LOAD);
+	pthread_cond_broadcast(&elem->rw_signal);
+	log_info("Page %zd has been loaded", elem->id);
+}
+
 static int dumper_page_load(struct CacheBase *cache, struct CacheElem *elem) {
 	int retval = pool_read(cache->pool, elem->id, elem->cache);
-	memcpy(elem->prev, elem->cache, cache->pool->page_size);
-	pthread_cond_signal(&elem->rw_signal);
-	log_info("Page %zd has been loaded", elem->id);
+	dumper_page_loaded(cache, elem);
 	return retval;	
 }
 
+/*
+ * Set up asynchronous I/O. It isn't used for the mapped pool (there's no
+ * syscall to save) or if io_uring isn't available.
+ */
+static int dumperi_io_init(struct DumperIO *io, struct PagePool *pp) {
+	size_t i = 0;
+	io->pp = pp;
+	io->nfree = 0;
+	if (pp->map || uring_init(&io->ring, DUMPER_DEPTH) == -1)
+		return -1;
+	io->bufs = pool_page_alloc(pp, DUMPER_DEPTH);
+	for (i = 0; i < DUMPER_DEPTH; ++i) {
+		io->slot[i].elem = NULL;
+		io->slot[i].buf  = NULL;
+		io->free[io->nfree++] = DUMPER_DEPTH - 1 - i;
+	}
+	return 0;
+}
+
+static void dumperi_io_free(struct DumperIO *io) {
+	uring_free(&io->ring);
+	free(io->bufs);
+	io->bufs = NULL;
+}
+
+/*
+ * Queue reading of the page into it's frame
+ */
+static int dumperi_io_read(struct DumperIO *io, struct CacheElem *elem) {
+	struct PagePool *pp = io->pp;
+	if (io->nfree == 0)
+		return -1;
+	size_t s = io->free[io->nfree - 1];
+	int fd = pool_page_fd(pp, elem->cache, pp->page_size, 0);
+	if (uring_queue(&io->ring, IORING_OP_READ, fd, elem->cache,
+			pp->page_size, elem->id * pp->page_size, s) == -1)
+		return -1;
+	io->nfree--;
+	io->slot[s].elem = elem;
+	io->slot[s].buf  = NULL;
+	return 0;
+}
+
+/*
+ * Queue writing of the dirty page (frame lock is held). Frame is marked
+ * as being written: it isn't evicted or written again, until it's done.
+ */
+static int dumperi_io_write(struct DumperIO *io, struct CacheElem *elem) {
+	struct PagePool *pp = io->pp;
+	if (io->nfree == 0)
+		return -1;
+	size_t s = io->free[io->nfree - 1];
+	void *buf = (char *)io->bufs + s * pp->page_size;
+	int   fd  = pool_page_fd(pp, buf, pp->page_size, 0);
+	if (uring_queue(&io->ring, IORING_OP_WRITE, fd, buf,
+			pp->page_size, elem->id * pp->page_size, s) == -1)
+		return -1;
+	memcpy(buf, elem->cache, pp->page_size);
+	io->nfree--;
+	io->slot[s].elem = elem;
+	io->slot[s].buf  = buf;
+	cachei_flag_clear(elem, CACHE_DIRTY);
+	cachei_flag_set(elem, CACHE_WRITE);
+	return 0;
+}
+
+/*
+ * Completion of the request. Failed (or short) one is redone synchronously.
+ */
+static void dumperi_io_done(void *arg, uint64_t data, int res) {
+	struct DumperIO   *io   = (struct DumperIO *)arg;
+	struct DumperSlot *slot = &io->slot[data];
+	struct CacheElem  *elem = slot->elem;
+	struct PagePool   *pp   = io->pp;
+	if (res != pp->page_size)
+		log_err("Async I/O of page %zd returned %d", elem->id, res);
+	if (slot->buf) {
+		if (res != pp->page_size)
+			pool_write(pp, slot->buf, pp->page_size, elem->id, 0);
+		pthread_mutex_lock(&elem->lock);
+		cachei_flag_clear(elem, CACHE_WRITE);
+		pthread_cond_broadcast(&elem->rw_signal);
+		pthread_mutex_unlock(&elem->lock);
+		log_info("Page %zd has been dumped", elem->id);
+	} else {
+		if (res != pp->page_size)
+			pool_read(pp, elem->id, elem->cache);
+		pthread_mutex_lock(&elem->lock);
+		dumper_page_loaded(pp->cache, elem);
+		pthread_mutex_unlock(&elem->lock);
+	}
+	slot->elem = NULL;
+	io->free[io->nfree++] = data;
+}
+
 #ifndef   pthread_mutex_timedlock
 #include <sys/time.h>
 int pthread_mutex_timedlock (pthread_mutex_t *mutex,
@@ -87,37 +211,65 @@ void *dumper_loop(void *arg) {
 	log_info("Creating RW Thread");
 	struct PagePool *pp = (struct PagePool *)arg;
 	struct CacheElem *elem_w = pp->cache->list_tail;
+	struct DumperIO io;
+	int async = (dumperi_io_init(&io, pp) == 0);
 	while (pp->dumper_enable) {
 		elem_w = elem_w->next;
-		if (elem_w == NULL)
+		if (elem_w == NULL) {
+			/* Bitmask is flushed once per pass over the cache */
+			pool_bitmask_flush(pp);
+			pool_sync(pp, 0);
 			elem_w =  pp->cache->list_tail;
-		if (elem_w->flag & CACHE_DIRTY) {
+		}
+		if ((elem_w->flag & CACHE_DIRTY) && !(elem_w->flag & CACHE_WRITE)) {
 			int retval = pthread_mutex_timedlock(&elem_w->lock, &ts);
 			if (retval == ETIMEDOUT) continue;
 			check(retval == 0, "Failed to lock mutex");
-			dumper_page_dump(pp->cache, elem_w);
-			elem_w->flag &= (-1 - CACHE_DIRTY);
+			/* page may have been dropped while we were waiting */
+			if ((elem_w->flag & CACHE_DIRTY) &&
+			    (!async || dumperi_io_write(&io, elem_w) == -1)) {
+				dumper_page_dump(pp->cache, elem_w);
+				cachei_flag_clear(elem_w, CACHE_DIRTY);
+			}
 			pthread_mutex_unlock(&elem_w->lock);
 		}
 		while (dumperi_readq_check(pp->cache)) {
 			struct CacheElem *elem_r = pp->cache->readq;
+			if (async) {
+				/* Read is completed, when it's reaped */
+				if (dumperi_io_read(&io, elem_r) == -1)
+					break;
+				dumperi_readq_dequeue(pp->cache);
+				continue;
+			}
 			pthread_mutex_lock(&elem_r->lock);
 			dumper_page_load(pp->cache, elem_r);
 			dumperi_readq_dequeue(pp->cache);
-			pthread_cond_signal(&elem_r->rw_signal);
 			pthread_mutex_unlock(&elem_r->lock);
 		}
+		if (async) {
+			check(uring_submit(&io.ring, 0) == 0, "Failed to submit I/O");
+			uring_reap(&io.ring, dumperi_io_done, &io);
+		}
+	}
+	while (async && io.nfree < DUMPER_DEPTH) {
+		check(uring_submit(&io.ring, 1) == 0, "Failed to submit I/O");
+		uring_reap(&io.ring, dumperi_io_done, &io);
 	}
 	elem_w = pp->cache->list_tail;
 	while (elem_w) {
 		if (elem_w->flag & CACHE_DIRTY) {
 			pthread_mutex_lock(&elem_w->lock);
 			dumper_page_dump(pp->cache, elem_w);
-			elem_w->flag &= (-1 - CACHE_DIRTY);
+			cachei_flag_clear(elem_w, CACHE_DIRTY);
 			pthread_mutex_unlock(&elem_w->lock);
 		}
 		elem_w = elem_w->next;
 	}
+	pool_bitmask_flush(pp);
+	pool_sync(pp, 1);
+	if (async)
+		dumperi_io_free(&io);
 	return procret;
 error:
 	*procret = 1;
@@ -1,203 +1,341 @@
 #include <string.h>
+#include <stdlib.h>
 #include <math.h>
 #include <assert.h>
 
+#include "dbg.h"
 #include "node.h"
+#include "blob.h"
+#include "pack.h"
 #include "btree.h"
 #include "insert.h"
 #include "wal.h"
 
 /**
- * @brief  Insert data into prepared Node
+ * @brief  Store value out of the node: packed, in the blob store or in the
+ *         data page of it's own (placed after the leaf)
  *
- * @return Status
+ * @param[out] ref    Reference to the value
+ * @param[out] vflags SLOT_PACKED, SLOT_BLOB or 0 (data page)
+ *
+ * @return Status (-1 if there's no space in the pool)
  */
-static int btreei_insert_data(struct DB *db, struct BTreeNode *node,
-		       void *val, int val_len, size_t pos) {
+static int btreei_store_data(struct DB *db, struct BTreeNode *node,
+			     void *val, int val_len,
+			     pageno_t *ref, uint16_t *vflags) {
+	*vflags = 0;
+	if (db->compress && pack_write(db, node->h->page, val, val_len, ref) == 0) {
+		*vflags = SLOT_PACKED;
+		return 0;
+	}
+	if (val_len > data_node_max_capacity(db)) {
+		*vflags = SLOT_BLOB;
+		check(blob_write(db, val, val_len, ref) == 0,
+		      "Can't store value of %d bytes", val_len);
+		return 0;
+	}
 	struct DataNode dnode = {0};
-	node_data_load(db, &dnode, 0);
+	check(node_data_create(db, &dnode, node->h->page) == 0,
+	      "Can't store value of %d bytes", val_len);
 	memcpy(dnode.data, val, val_len);
 	dnode.h->size = val_len;
-	node->vals[pos] = dnode.h->page;
+	*ref = dnode.h->page;
 	node_data_dump(db, &dnode);
-	node_btree_dump(db, node);
 	node_free(db, &dnode);
 	return 0;
+error:
+	return -1;
+}
+
+/**
+ * @brief  Set value of the key at position pos of prepared Node (node
+ *         itself isn't dumped). Value is stored, before the slot refers to
+ *         it, so the slot isn't changed, if it can't be stored.
+ *
+ * @return Status
+ */
+static int btreei_insert_data(struct DB *db, struct BTreeNode *node,
+		       void *val, int val_len, size_t pos) {
+	if (val_len <= db->inline_max &&
+	    node_btree_set_val(db, node, pos, 0, 0, val, val_len) == 0)
+		return 0;
+	pageno_t ref    = 0;
+	uint16_t vflags = 0;
+	if (btreei_store_data(db, node, val, val_len, &ref, &vflags) == -1)
+		return -1;
+	return node_btree_set_val(db, node, pos, ref, vflags, NULL, 0);
 }
 
 /**
- * @brief  Replace data in the Node
+ * @brief  Replace data in the Node. Old value is freed, once the new one
+ *         is in place, so it's kept, if the new one can't be stored.
  *
  * @return Status
  */
 static int btreei_replace_data(struct DB *db, struct BTreeNode *node,
-		char *val, int val_len, size_t pos) {
-	node_deallocate(db, node->vals[pos]);
-	btreei_insert_data(db, node, val, val_len, pos);
+		void *val, int val_len, size_t pos) {
+	int      blob   = NODE_BLOB(node, pos);
+	int      packed = NODE_PACKED(node, pos);
+	int      inl    = NODE_INLINE(node, pos);
+	pageno_t old    = NODE_VAL(node, pos);
+	if (btreei_insert_data(db, node, val, val_len, pos) == -1)
+		return -1;
+	if (blob)
+		blob_free(db, old);
+	else if (packed)
+		pack_free(db, old);
+	else if (!inl)
+		node_deallocate(db, old);
 	return 0;
 }
 
 /**
- * @brief Prepare node for inserting data
+ * @brief  Insert into B-Tree leaf by string and string (or replace value
+ *         of the key). Leaf isn't dumped. Key is removed again, if value
+ *         can't be stored.
+ *
+ * @return Status
  */
-static void btreei_insert_into_node_prepare(struct DB *db, struct BTreeNode *node,
-				     char *key, size_t pos, size_t child) {
-	int isLeaf = node->h->flags & IS_LEAF;
-	assert(!(isLeaf ^ !child) || NODE_FULL(db, node));
-	memmove(NODE_KEY_POS(node, pos + 1),
-		NODE_KEY_POS(node, pos),
-		(node->h->size - pos) * BTREE_KEY_LEN);
-	memmove(NODE_VAL_POS(node, pos + 1),
-		NODE_VAL_POS(node, pos),
-		(node->h->size - pos) * sizeof(size_t));
-	if (!isLeaf) {
-		memmove(NODE_CHLD_POS(node, pos + 2),
-			NODE_CHLD_POS(node, pos + 1),
-			(node->h->size - pos) * sizeof(size_t));
-		node->chld[pos + 1] = child;
+static int btreei_insert_into_leaf(struct DB *db, struct BTreeNode *node,
+			void *key, size_t key_len, void *val, int val_len) {
+	int    cmp = -1;
+	size_t pos = node_key_search(node, key, key_len, &cmp);
+	if (cmp == 0)
+		return btreei_replace_data(db, node, val, val_len, pos);
+	assert(!NODE_FULL(db, node));
+	node_btree_insert(db, node, pos, key, key_len, 0, 0);
+	if (btreei_insert_data(db, node, val, val_len, pos) == 0)
+		return 0;
+	node_btree_remove(db, node, pos);
+	return -1;
+}
+
+/**
+ * @brief  Find position of the key to split node at, so both halves take
+ *         roughly the same space
+ */
+static size_t btreei_split_pos(struct DB *db, struct BTreeNode *node) {
+	size_t half = node_btree_used(db, node) / 2;
+	size_t used = 0, pos = 0;
+	while (pos + 1 < node->h->size) {
+		used += NODE_ENTRY_SIZE(NODE_REC_LEN(node, pos));
+		if (used >= half)
+			break;
+		++pos;
 	}
-	node->h->size += 1;
-	strncpy(NODE_KEY_POS(node, pos), key, BTREE_KEY_LEN-1);
+	return pos;
 }
 
 /**
- * @brief  Insert into B-Tree by string and pointer
- *
- * @return Status
+ * @brief  Link new leaf right into the leaf chain after the leaf node
  */
-static int btreei_insert_into_node_sp(struct DB *db, struct BTreeNode *node, char *key,
-			size_t data_page, size_t pos, size_t child) {
-	btreei_insert_into_node_prepare(db, node, key, pos, child);
-	node->vals[pos] = data_page;
-	return node_btree_dump(db, node);
+static void btreei_link_leaf(struct DB *db, struct BTreeNode *node,
+			     struct BTreeNode *right) {
+	node_write(db, node);
+	right->h->prev = node->h->page;
+	right->h->next = node->h->next;
+	node->h->next  = right->h->page;
+	if (right->h->next) {
+		struct BTreeNode next;
+		node_btree_load(db, &next, right->h->next);
+		node_write(db, &next);
+		next.h->prev = right->h->page;
+		node_btree_dump(db, &next);
+		node_free(db, &next);
+	}
 }
 
 /**
- * @brief  Insert into B-Tree by string and string
- *
- * @return Status
+ * @brief  Move content of the top node into the new node, which becomes
+ *         the only child of the top (top page never changes)
  */
-static int btreei_insert_into_node_ss(struct DB *db, struct BTreeNode *node, char *key,
-			char *val, int val_len, size_t pos, size_t child) {
-	btreei_insert_into_node_prepare(db, node, key, pos, child);
-	btreei_insert_data(db, node, val, val_len, pos);
-	return node_btree_dump(db, node);
+static void btreei_grow_top(struct DB *db, struct BTreeNode *node,
+			    struct BTreeNode *kid) {
+	node_btree_create(db, kid, node->h->page);
+	pageno_t page = kid->h->page;
+	memcpy(kid->h, node->h, db->pool->page_size);
+	kid->h->page   = page;
+	kid->h->flags &= ~IS_TOP;
+	node_btree_truncate(db, node, 0);
+	node->h->flags = IS_TOP;
+	node->h->next  = node->h->prev = 0;
+	NODE_CHLD(node, 0) = page;
 }
 
 /**
- * @brief  B-Tree split operation
+ * @brief  B-Tree split operation: upper half of the node goes into the new
+ *         right node, separator is inserted into parent at position pos.
+ *         Leaf keeps all keys, so separator is a copy of first key of the
+ *         right leaf. Internal node gives it's middle key to the parent.
  *
  * @return Status
  */
-static int btreei_split_node(struct DB *db,
-		struct BTreeNode *parent,
-		struct BTreeNode *node) {
-	assert(!(parent && NODE_FULL(db, parent)));
+static int btreei_split_node(struct DB *db, struct BTreeNode *parent,
+			     size_t pos, struct BTreeNode *node) {
+	assert(!NODE_FULL(db, parent));
 	int isLeaf = node->h->flags & IS_LEAF;
-	size_t middle = ceil((double )node->h->size/2) - 1;
+	size_t middle = btreei_split_pos(db, node);
 	struct BTreeNode right;
-	node_btree_load(db, &right, 0);
-	if (isLeaf) right.h->flags |= IS_LEAF;
-	memcpy(right.keys, NODE_KEY_POS(node, middle + 1),
-	       BTREE_KEY_LEN  * (node->h->size - middle - 1));
-	memcpy(right.vals, NODE_VAL_POS(node, middle + 1),
-	       sizeof(size_t) * (node->h->size - middle - 1));
-	memcpy(right.chld, NODE_CHLD_POS(node, middle + 1),
-	       sizeof(size_t) * (node->h->size - middle));
-#ifdef DEBUG
-// 	memset(NODE_KEY_POS(node, middle + 1), 0,
-// 	       BTREE_KEY_LEN * (node->h->size - middle - 1));
-// 	memset(NODE_VAL_POS(node, middle + 1), 0,
-// 	       sizeof(size_t) * (node->h->size - middle - 1));
-// 	memset(NODE_CHLD_POS(node, middle + 1), 0,
-// 	       sizeof(size_t) * (node->h->size - middle));
-#endif
-	right.h->size = node->h->size - middle - 1;
-	node->h->size = middle + 1;
-	if (parent == NULL) { /* It's top node */
-		struct BTreeNode left;
-		node_btree_load(db, &left, 0);
-		if (isLeaf) left.h->flags |= IS_LEAF;
-		if (isLeaf) node->h->flags ^= IS_LEAF;
-		memcpy(left.keys, node->keys, BTREE_KEY_LEN  * middle);
-		memcpy(left.vals, node->vals, sizeof(size_t) * middle);
-		memcpy(left.chld, node->chld, sizeof(size_t) * (middle + 1));
-#ifdef DEBUG
-// 		memset(node->keys, 0, BTREE_KEY_LEN * middle);
-// 		memset(node->vals, 0, sizeof(size_t) * middle);
-// 		memset(node->chld, 0, sizeof(size_t) * (middle + 1));
-#endif
-		left.h->size = middle;
-		memmove(node->keys, NODE_KEY_POS(node, middle), BTREE_KEY_LEN);
-		node->vals[0] = node->vals[middle];
-		node->chld[0] = left.h->page;
-		node->chld[1] = right.h->page;
-		node->h->size = 1;
-		node_btree_dump(db, &left);
-		node_free(db, &left);
+	node_btree_create(db, &right, node->h->page);
+	if (isLeaf) {
+		right.h->flags |= IS_LEAF;
+		btreei_link_leaf(db, node, &right);
+	}
+	NODE_CHLD(&right, 0) = NODE_CHLD(node, middle + 1);
+	node_btree_append(db, &right, node, middle + 1,
+			  node->h->size - middle - 1);
+	if (isLeaf) {
+		node_btree_truncate(db, node, middle + 1);
+		node_btree_insert(db, parent, pos, NODE_KEY_POS(&right, 0),
+				  NODE_KEY_LEN(&right, 0), 0, right.h->page);
 	} else {
-		size_t pos =  0;
-		while (pos < parent->h->size && node->h->page != parent->chld[pos])
-			pos++;
-//		assert(pos == parent->h->size);
-		btreei_insert_into_node_sp(db, parent,
-					   NODE_KEY_POS(node, middle),
-				           node->vals[middle], pos,
-					   right.h->page);
-		--node->h->size;
+		node_btree_insert(db, parent, pos, NODE_KEY_POS(node, middle),
+				  NODE_KEY_LEN(node, middle), 0, right.h->page);
+		node_btree_truncate(db, node, middle);
 	}
+	node_btree_dump(db, parent);
 	node_btree_dump(db, node);
 	node_btree_dump(db, &right);
 	node_free(db, &right);
 	return 0;
 }
 
+/**
+ * @brief  Load child of the node, which subtree may hold key, splitting
+ *         it on the way, if it's full
+ *
+ * @return Position of the child
+ */
+static size_t btreei_insert_child(struct DB *db, struct BTreeNode *node,
+				  void *key, size_t key_len,
+				  struct BTreeNode *child) {
+	size_t pos = node_key_child(node, key, key_len);
+	node_btree_load(db, child, NODE_CHLD(node, pos));
+	if (NODE_FULL(db, child)) {
+		btreei_split_node(db, node, pos, child);
+		if (node_key_cmp(node, pos, key, key_len) <= 0) {
+			node_free(db, child);
+			pos++;
+			node_btree_load(db, child, NODE_CHLD(node, pos));
+		}
+	}
+	return pos;
+}
+
+/**
+ * @brief  Split the top node, if it's full
+ */
+static void btreei_insert_top(struct DB *db, struct BTreeNode *node) {
+	if (node->h->flags & IS_TOP && NODE_FULL(db, node)) { /* UNLIKELY */
+		struct BTreeNode kid;
+		btreei_grow_top(db, node, &kid);
+		btreei_split_node(db, node, 0, &kid);
+		node_free(db, &kid);
+	}
+}
+
+static int btreei_insert_key(struct DB *db, struct BTreeNode *node,
+		void *key, size_t key_len, void *val, int val_len) {
+	if (node->h->flags & IS_LEAF) {
+		int retval = btreei_insert_into_leaf(db, node, key, key_len,
+						     val, val_len);
+		node_btree_dump(db, node);
+		return retval;
+	}
+	struct BTreeNode child;
+	btreei_insert_child(db, node, key, key_len, &child);
+	int retval = btreei_insert_key(db, &child, key, key_len, val, val_len);
+	node_free(db, &child);
+	return retval;
+}
+
 /**
  * @brief  B-Tree insert operation
  *
  * @return Status
  */
 int btreei_insert(struct DB *db, struct BTreeNode *node,
-		  char *key, char *val, int val_len) {
-	wal_write_begin(db, OP_INSERT, key, strlen(key), val, val_len);
-	if (node->h->flags & IS_TOP && NODE_FULL(db, node)) /* UNLIKELY */
-		btreei_split_node(db, NULL, node);
-	size_t pos =  0;
-	int    cmp = -1;
-	while (pos < node->h->size) {
-		cmp = strncmp(NODE_KEY_POS(node, pos), key, BTREE_KEY_LEN);
-		if (cmp >= 0)
-			break;
-		++pos;
+		  void *key, size_t key_len, void *val, int val_len) {
+	wal_write_begin(db, OP_INSERT, key, key_len, val, val_len);
+	btreei_insert_top(db, node);
+	int retval = btreei_insert_key(db, node, key, key_len, val, val_len);
+	wal_write_finish(db);
+	return retval;
+}
+
+/*
+ * Insert sorted items [from, to) into subtree of the node (which isn't
+ * full), so items, landing in the same leaf, share one descent and one
+ * dump of the leaf. Stops, when node gets full.
+ *
+ * Returns number of inserted items
+ */
+static size_t btreei_insert_items(struct DB *db, struct BTreeNode *node,
+				  struct DBItem **items, size_t from, size_t to) {
+	size_t i = from;
+	if (node->h->flags & IS_LEAF) {
+		for (; i < to && (i == from || !NODE_FULL(db, node)); ++i)
+			btreei_insert_into_leaf(db, node, items[i]->key,
+						items[i]->key_len, items[i]->val,
+						items[i]->val_len);
+		node_btree_dump(db, node);
+		return i - from;
 	}
-	if (cmp == 0) {
-		btreei_replace_data(db, node, val, val_len, pos);
-	} else {
-		if (node->h->flags & IS_LEAF) {
-			btreei_insert_into_node_ss(db, node, key, val, val_len, pos, 0);
-		} else {
-			struct BTreeNode child;
-			node_btree_load(db, &child, node->chld[pos]);
-			if (NODE_FULL(db, (&child))) {
-				btreei_split_node(db, node, &child);
-				if (strncmp(NODE_KEY_POS(node, pos),
-					key, BTREE_KEY_LEN) > 0) {
-					btreei_insert(db, &child, key, val, val_len);
-				} else {
-					struct BTreeNode rnode;
-					node_btree_load(db, &rnode, node->chld[pos+1]);
-					btreei_insert(db, &rnode, key, val, val_len);
-					node_btree_dump(db, &rnode);
-					node_free(db, &rnode);
-				}
-			} else {
-				btreei_insert(db, &child, key, val, val_len);
-			}
-			node_btree_dump(db, &child);
-			node_free(db, &child);
-		}
+	while (i < to && (i == from || !NODE_FULL(db, node))) {
+		struct BTreeNode child;
+		size_t pos = btreei_insert_child(db, node, items[i]->key,
+						 items[i]->key_len, &child);
+		/* Items up to the next separator land in this child */
+		size_t end = i + 1;
+		while (end < to && (pos == node->h->size ||
+		       node_key_cmp(node, pos, items[end]->key,
+				    items[end]->key_len) > 0))
+			++end;
+		i += btreei_insert_items(db, &child, items, i, end);
+		node_free(db, &child);
+	}
+	return i - from;
+}
+
+static int btreei_item_cmp(const void *a, const void *b) {
+	const struct DBItem *l = *(const struct DBItem **)a;
+	const struct DBItem *r = *(const struct DBItem **)b;
+	int cmp = node_key_cmp_raw(l->key, l->key_len, r->key, r->key_len);
+	if (cmp)
+		return cmp;
+	return (l > r) - (l < r);
+}
+
+/**
+ * @brief  B-Tree insert operation for the batch of items: they're sorted
+ *         and logged as one WAL record group. If key repeats, the last
+ *         item wins.
+ *
+ * @return Status
+ */
+int btreei_insert_batch(struct DB *db, struct BTreeNode *node,
+			struct DBItem *items, size_t count) {
+	struct DBItem **sorted = malloc(count * sizeof(struct DBItem *));
+	check_mem(sorted, count * sizeof(struct DBItem *));
+	size_t i = 0, uniq = 0;
+	for (i = 0; i < count; ++i)
+		sorted[i] = &items[i];
+	qsort(sorted, count, sizeof(struct DBItem *), btreei_item_cmp);
+	for (i = 0; i < count; ++i) {
+		if (i + 1 < count &&
+		    node_key_cmp_raw(sorted[i]->key, sorted[i]->key_len,
+				     sorted[i + 1]->key, sorted[i + 1]->key_len) == 0)
+			continue;
+		sorted[uniq++] = sorted[i];
+	}
+	wal_write_begin(db, OP_BATCH, NULL, 0, NULL, 0);
+	for (i = 0; i < uniq; ) {
+		btreei_insert_top(db, node);
+		i += btreei_insert_items(db, node, sorted, i, uniq);
 	}
 	wal_write_finish(db);
+	free(sorted);
 	return 0;
+error:
+	exit(-1);
 }
-
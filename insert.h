@@ -2,6 +2,9 @@
 #define _BTREE_INSERT_H_
 
 int btreei_insert(struct DB *db, struct BTreeNode *node,
-		  char *key, char *val, int val_len);
+		  void *key, size_t key_len, void *val, int val_len);
+
+int btreei_insert_batch(struct DB *db, struct BTreeNode *node,
+			struct DBItem *items, size_t count);
 
 #endif /* _BTREE_INSERT_H_ */
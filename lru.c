@@ -1,67 +1,222 @@
 #include <assert.h>
+#include <stdlib.h>
 
 #include "dbg.h"
 #include "cache.h"
 #include "pagepool.h"
 #include "dumper.h"
 
-#include <uthash.h>
-#include <utlist.h>
+/*
+ *  /CLOCK/
+ *  shard ring (circular)     hand
+ *                            ||
+ *                            \/
+ *  |----|----|----|----|----|----|----|----|----|----|----|----|----|----|
+ *                            -->
+ *
+ * Hand goes round the shard ring: frame, that isn't busy, is taken, unless
+ * it has CACHE_REF - then it only loses the bit (second chance). Hit costs
+ * setting of the bit, miss - O(1) frames on average.
+ */
+struct ClockState {
+	struct CacheElem *hand; /* Next frame to check for replacement */
+};
 
-static int find_unused(struct CacheElem *l1, struct CacheElem *l2) {
-	return (l1->flag & CACHE_USED) || (l1->flag & CACHE_DIRTY);
+static int clock_init(struct CacheShard *shard) {
+	struct ClockState *clock = malloc(sizeof(struct ClockState));
+	check_mem(clock, sizeof(struct ClockState));
+	clock->hand   = shard->ring;
+	shard->policy = clock;
+	return 0;
+error:
+	return -1;
+}
+
+static void clock_free(struct CacheShard *shard) {
+	free(shard->policy);
+	shard->policy = NULL;
+}
+
+/*
+ * Frames are in the shard ring already, CACHE_REF is set by the getter
+ */
+static void clock_none(struct CacheShard *shard, struct CacheElem *elem) {
+}
+
+static struct CacheElem *clock_victim(struct CacheShard *shard, pageno_t page) {
+	struct ClockState *clock = (struct ClockState *)shard->policy;
+	size_t n = 0;
+	/* Every frame loses CACHE_REF in the first round, so two will do */
+	for (n = 0; n < 2 * shard->frames; ++n) {
+		struct CacheElem *elem = clock->hand;
+		clock->hand = elem->ring;
+		if (cachei_frame_busy(elem))
+			continue;
+		if (!(elem->flag & CACHE_REF))
+			return elem;
+		cachei_flag_clear(elem, CACHE_REF);
+	}
+	return NULL;
 }
 
-static struct CacheElem *lru_page_get_free(struct CacheBase *cache) {
-	struct CacheElem *retval = NULL;
-	LL_SEARCH(cache->list_tail, retval, NULL, find_unused);
+const struct CachePolicy cache_policy_clock = {
+	"clock", clock_init, clock_free, clock_none, clock_none,
+	clock_victim, clock_none, clock_none
+};
+
+/*
+ * Add new frame to the end of the list and to the shard ring (when all
+ * frames of the shard are busy)
+ */
+static struct CacheElem *lrui_frame_add(struct CacheBase *cache,
+					struct CacheShard *shard) {
+	struct CacheElem *elem = cachei_page_alloc(cache);
+	/* Dumper may be walking the list: frame is complete before it's linked */
+	pthread_mutex_lock(&cache->list_lock);
+	cache->list_head->next = elem;
+	cache->list_head = elem;
+	cache->frames++;
+	pthread_mutex_unlock(&cache->list_lock);
+	elem->ring = shard->ring->ring;
+	shard->ring->ring = elem;
+	shard->frames++;
+	cache->policy->add(shard, elem);
+	log_info("All %zd frames of the shard are busy, cache grows",
+		 shard->frames - 1);
+	return elem;
+}
+
+/*
+ * Take frame of the shard (latch is held), that the policy gives away,
+ * for the new page
+ */
+static struct CacheElem *lru_page_get_free(struct CacheBase *cache,
+					   struct CacheShard *shard,
+					   pageno_t page) {
+	struct CacheElem *retval = cache->policy->victim(shard, page);
 	if (retval == NULL) {
-		retval = cachei_page_alloc(cache);
-	} else {
-		LL_DELETE(cache->list_tail, retval);
+		lrui_frame_add(cache, shard);
+		retval = cache->policy->victim(shard, page);
+		check(retval != NULL, "Cache policy %s gives no empty frame",
+		      cache->policy->name);
 	}
-	retval->flag |= CACHE_USED;
-	LL_APPEND(cache->list_head, retval);
+	/* Page, the frame held, isn't cached anymore */
+	if (cachei_hash_find(shard, retval->id) == retval)
+		cachei_hash_del(shard, retval);
+	cachei_page_release(cache, retval);
+	retval->id    = page;
+	cachei_flag_clear(retval, CACHE_REF);
+	cachei_flag_set(retval, CACHE_USED | CACHE_LOAD);
+	cachei_hash_add(shard, retval);
+	cache->policy->admit(shard, retval);
 	return retval;
+error:
+	exit(-1);
+}
+
+/*
+ * Wait until the dumper reads the page into the frame
+ */
+static void lrui_page_wait(struct CacheBase *cache, struct CacheElem *elem) {
+	pthread_mutex_lock(&elem->lock);
+	while (elem->flag & CACHE_LOAD)
+		pthread_cond_wait(&elem->rw_signal, &elem->lock);
+	pthread_mutex_unlock(&elem->lock);
 }
 
-struct CacheElem *lrui_page_get(struct CacheBase *cache, pageno_t page, int nolock) {
-	struct CacheElem *elem = NULL;
-	HASH_FIND_INT(cache->hash, &page, elem);
+/*
+ * Find page in the cache or read it there. Pinned frame (pin != 0) can't
+ * be taken by another page until it's freed (see lru_page_free); it's
+ * pinned under the shard latch, so it isn't taken meanwhile either.
+ */
+struct CacheElem *lrui_page_get(struct CacheBase *cache, pageno_t page, int pin) {
+	struct CacheShard *shard = cachei_shard(cache, page);
+	int miss = 0;
+	pthread_mutex_lock(&shard->latch);
+	struct CacheElem *elem = cachei_hash_find(shard, page);
 	if (elem == NULL) {
-		elem = lru_page_get_free(cache);
-		if (!nolock) {
-			pthread_mutex_lock(&elem->lock); 
-			log_info("Locking page %zd", page);
-		}
-		elem->id = page;
-		elem->flag |= CACHE_USED;
-		HASH_ADD_INT(cache->hash, id, elem);
-		//pool_read(cache->pool, page, elem->cache);
+		elem = lru_page_get_free(cache, shard, page);
+		miss = 1;
+	} else if (pin) {
+		cache->policy->hit(shard, elem);
+	}
+	if (pin) {
+		cachei_flag_set(elem, CACHE_USED | CACHE_REF);
+		elem->pins++;
+	}
+	pthread_mutex_unlock(&shard->latch);
+	if (miss) {
 		dumper_readq_enqueue(cache, elem);
-		pthread_cond_wait(&elem->rw_signal, &elem->lock);
-		memcpy(elem->prev, elem->cache, cache->pool->page_size);
 		log_info("Getting page %zd from disk", page);
 	} else {
-		if (!nolock) {
-			pthread_mutex_lock(&elem->lock);
-			log_info("Locking page %zd", page);
-		}
 		log_info("Getting page %zd from memory", page);
 	}
+	/* Page is queued for reading (here or by prefetch), but isn't read yet */
+	if (elem->flag & CACHE_LOAD)
+		lrui_page_wait(cache, elem);
 	return elem;
 }
 
+/*
+ * Queue reading of the page, if it isn't cached, without waiting for it.
+ * Frame stays used (until the page is got and freed), so it can't be
+ * taken by another page meanwhile.
+ */
+int lru_page_prefetch(struct CacheBase *cache, pageno_t page) {
+	struct CacheShard *shard = cachei_shard(cache, page);
+	pthread_mutex_lock(&shard->latch);
+	struct CacheElem *elem = cachei_hash_find(shard, page);
+	if (elem != NULL) {
+		pthread_mutex_unlock(&shard->latch);
+		return 0;
+	}
+	elem = lru_page_get_free(cache, shard, page);
+	pthread_mutex_unlock(&shard->latch);
+	log_info("Prefetching page %zd", page);
+	return dumper_readq_enqueue(cache, elem);
+}
+
+/*
+ * Take frame for the page, that isn't cached, to read it there bypassing
+ * the dumper (NULL if it's cached). Getters of the page wait for it, until
+ * the reader calls lrui_page_loaded.
+ */
+struct CacheElem *lrui_page_claim(struct CacheBase *cache, pageno_t page) {
+	struct CacheShard *shard = cachei_shard(cache, page);
+	struct CacheElem  *elem  = NULL;
+	pthread_mutex_lock(&shard->latch);
+	if (cachei_hash_find(shard, page) == NULL)
+		elem = lru_page_get_free(cache, shard, page);
+	pthread_mutex_unlock(&shard->latch);
+	return elem;
+}
+
+/*
+ * Page is read into the claimed frame: wake up getters, frame may be
+ * taken by another page, unless they pinned it
+ */
+void lrui_page_loaded(struct CacheBase *cache, struct CacheElem *elem) {
+	struct CacheShard *shard = cachei_shard(cache, elem->id);
+	pthread_mutex_lock(&elem->lock);
+	cachei_flag_clear(elem, CACHE_LOAD);
+	pthread_cond_broadcast(&elem->rw_signal);
+	pthread_mutex_unlock(&elem->lock);
+	pthread_mutex_lock(&shard->latch);
+	if (elem->pins == 0)
+		cachei_flag_clear(elem, CACHE_USED);
+	pthread_mutex_unlock(&shard->latch);
+}
+
 void *lru_page_get(struct CacheBase *cache, pageno_t page) {
 	return lrui_page_get(cache, page, 1)->cache;
 }
 
 int lru_page_free(struct CacheBase *cache, pageno_t page) {
-	struct CacheElem *elem = NULL;
-	HASH_FIND_INT(cache->hash, &page, elem);
-	memcpy(elem->prev, elem->cache, cache->pool->page_size);
-	pthread_mutex_unlock(&elem->lock);
-	log_info("Unocking page %zd", page);
-	if (elem != NULL) elem->flag &= (-1 - CACHE_USED);
+	struct CacheShard *shard = cachei_shard(cache, page);
+	pthread_mutex_lock(&shard->latch);
+	struct CacheElem *elem = cachei_hash_find(shard, page);
+	if (elem != NULL && elem->pins > 0 && --elem->pins == 0)
+		cachei_flag_clear(elem, CACHE_USED);
+	pthread_mutex_unlock(&shard->latch);
 	return 0;
 }
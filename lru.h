@@ -1,6 +1,9 @@
 #ifndef   _BTREE_LRU_H_
 #define   _BTREE_LRU_H_
 void *lru_page_get (struct CacheBase *cache, pageno_t page);
-struct CacheElem *lrui_page_get (struct CacheBase *cache, pageno_t page, int nolock);
+struct CacheElem *lrui_page_get (struct CacheBase *cache, pageno_t page, int pin);
 int   lru_page_free(struct CacheBase *cache, pageno_t page);
+int   lru_page_prefetch(struct CacheBase *cache, pageno_t page);
+struct CacheElem *lrui_page_claim (struct CacheBase *cache, pageno_t page);
+void  lrui_page_loaded(struct CacheBase *cache, struct CacheElem *elem);
 #endif /* _BTREE_LRU_H_ */
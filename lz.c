@@ -0,0 +1,165 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+/*
+ * LZ77 codec, producing LZ4 block format: sequence of
+ *
+ * |token|literal length+|literals|offset (LE16)|match length+|
+ *
+ * token keeps 4 bits of literal length and 4 bits of match length - 4,
+ * 15 means, that length goes on in the following bytes (255 - more bytes
+ * follow). The last sequence has literals only. Compressor is greedy with
+ * one hash table probe per position - fast and good enough for pages.
+ */
+
+#define LZ_HASH_LOG      12
+#define LZ_MIN_MATCH     4
+#define LZ_LAST_LITERALS 5     /* Block ends with literals */
+#define LZ_MFLIMIT       12    /* The last match starts that far from the end */
+#define LZ_MAX_OFFSET    65535
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/*
+ * Write the rest of the length (after 15 in the token)
+ * Returns NULL when there's no space
+ */
+static uint8_t *lz_put_len(uint8_t *op, uint8_t *oend, size_t len) {
+	for (; len >= 255; len -= 255) {
+		if (op >= oend) return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend) return NULL;
+	*op++ = (uint8_t )len;
+	return op;
+}
+
+/*
+ * Write sequence (without match, if match_len is 0)
+ * Returns NULL when there's no space
+ */
+static uint8_t *lz_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			   size_t lit_len, size_t offset, size_t match_len) {
+	if (op >= oend) return NULL;
+	uint8_t *token = op++;
+	*token = (uint8_t )((lit_len >= 15 ? 15 : lit_len) << 4);
+	if (lit_len >= 15 && !(op = lz_put_len(op, oend, lit_len - 15)))
+		return NULL;
+	if ((size_t )(oend - op) < lit_len) return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (match_len == 0)
+		return op;
+	if (oend - op < 2) return NULL;
+	*op++ = (uint8_t )(offset & 0xff);
+	*op++ = (uint8_t )(offset >> 8);
+	match_len -= LZ_MIN_MATCH;
+	*token |= (uint8_t )(match_len >= 15 ? 15 : match_len);
+	if (match_len >= 15 && !(op = lz_put_len(op, oend, match_len - 15)))
+		return NULL;
+	return op;
+}
+
+/**
+ * @brief     Compress len bytes of src into dst
+ *
+ * @param cap Size of dst
+ *
+ * @return    Compressed length (0 if it doesn't fit into cap bytes)
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+	const uint8_t *in = (const uint8_t *)src, *end = in + len;
+	const uint8_t *ip = in, *anchor = in;
+	uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+	uint32_t table[1 << LZ_HASH_LOG];
+	memset(table, 0, sizeof(table));
+	if (len > LZ_MFLIMIT) {
+		const uint8_t *limit = end - LZ_MFLIMIT;
+		const uint8_t *mend  = end - LZ_LAST_LITERALS;
+		while (ip < limit) {
+			uint32_t seq = lz_read32(ip), h = lz_hash(seq);
+			const uint8_t *ref = in + table[h];
+			table[h] = (uint32_t )(ip - in);
+			if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+			    lz_read32(ref) != seq) {
+				ip++;
+				continue;
+			}
+			size_t match_len = LZ_MIN_MATCH;
+			while (ip + match_len < mend && ref[match_len] == ip[match_len])
+				match_len++;
+			while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+				match_len++;
+			}
+			op = lz_put_seq(op, oend, anchor, ip - anchor, ip - ref, match_len);
+			if (!op) return 0;
+			ip += match_len;
+			anchor = ip;
+			table[lz_hash(lz_read32(ip - 2))] = (uint32_t )(ip - 2 - in);
+		}
+	}
+	op = lz_put_seq(op, oend, anchor, end - anchor, 0, 0);
+	return (op ? op - (uint8_t *)dst : 0);
+}
+
+/**
+ * @brief     Decompress len bytes of src into dst
+ *
+ * @param cap Size of dst
+ *
+ * @return    Decompressed length (-1 if src is corrupted or doesn't fit)
+ */
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap) {
+	const uint8_t *ip = (const uint8_t *)src, *iend = ip + len;
+	uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+	uint8_t  b = 0;
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15) do {
+			if (ip >= iend) return -1;
+			lit += (b = *ip++);
+		} while (b == 255);
+		if ((size_t )(iend - ip) < lit || (size_t )(oend - op) < lit)
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			break;
+		if (iend - ip < 2) return -1;
+		size_t offset = ip[0] | (size_t )ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (size_t )(op - (uint8_t *)dst))
+			return -1;
+		size_t match_len = token & 15;
+		if (match_len == 15) do {
+			if (ip >= iend) return -1;
+			match_len += (b = *ip++);
+		} while (b == 255);
+		match_len += LZ_MIN_MATCH;
+		if ((size_t )(oend - op) < match_len)
+			return -1;
+		const uint8_t *ref = op - offset;
+		if (offset >= match_len) {
+			memcpy(op, ref, match_len);
+			op += match_len;
+		} else {
+			/* Match overlaps it's own output (repeated pattern) */
+			while (match_len--) *op++ = *ref++;
+		}
+	}
+	return op - (uint8_t *)dst;
+}
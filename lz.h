@@ -0,0 +1,10 @@
+#ifndef _BTREE_LZ_H_
+#define _BTREE_LZ_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+size_t  lz_compress  (const void *src, size_t len, void *dst, size_t cap);
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _BTREE_LZ_H_ */
@@ -7,6 +7,9 @@ struct Metadata {
 	size_t pool_size;
 	size_t page_size;
 	pageno_t header_page;
+	size_t inline_max;
+	size_t pool_grow;
+	size_t compress;
 };
 
 int meta_check(char *db_name);
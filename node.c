@@ -1,6 +1,14 @@
 #include <assert.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
 
 #include "dbg.h"
+#include "node.h"
 #include "btree.h"
 #include "cache.h"
 #include "pagepool.h"
@@ -16,17 +24,410 @@
  * @return     Status
  */
 int node_btree_load(struct DB *db, struct BTreeNode *node, pageno_t page) {
-	int page_new = (page == 0 ? 1 : 0);
-	if (page_new) page = pool_alloc(db->pool);
-	node->h = (struct NodeHeader *)cache_page_get(db->pool->cache, page);
+	if (page == 0)
+		return node_btree_create(db, node, 0);
+	void *buf = cache_page_get(db->pool->cache, page);
+	node->h = (struct NodeHeader *)buf;
 	node->chld = (void *)node->h + sizeof(struct NodeHeader);
-	node->vals = (void *)(node->chld + (db->btree_degree + 1));
-	node->keys = (void *)(node->vals + db->btree_degree);
-	if (page_new) memset(node->h, 0, db->pool->page_size);
+	node->slots = (void *)(node->chld + 1);
+	/* Page may be shared by readers: it isn't written, unless it's needed */
+	if (node->h->page != page)
+		node->h->page = page;
+	return 0;
+}
+
+/**
+ * @brief      Create new btree node (cached version)
+ *
+ * @param[in]  db   Current Database instance
+ * @param[out] node Node for initialization
+ * @param[in]  near Page, new node should be placed after (0 if any page
+ *                  will do), e.g. left sibling of the node
+ *
+ * @return     Status
+ */
+int node_btree_create(struct DB *db, struct BTreeNode *node, pageno_t near) {
+	pageno_t page = pool_alloc_near(db->pool, near, 0);
+	void *buf = cache_page_get(db->pool->cache, page);
+	return node_btree_init(db, node, buf, page);
+}
+
+/**
+ * @brief      Initialize empty btree node in the given buffer
+ *             (not cached version)
+ *
+ * @param[in]  db   Current Database instance
+ * @param[out] node Node for initialization
+ * @param[in]  buf  Buffer of page size
+ * @param[in]  page Page number of the node
+ *
+ * @return     Status
+ */
+int node_btree_init(struct DB *db, struct BTreeNode *node, void *buf,
+		    pageno_t page) {
+	memset(buf, 0, db->pool->page_size);
+	node->h = (struct NodeHeader *)buf;
+	node->chld = (void *)node->h + sizeof(struct NodeHeader);
+	node->slots = (void *)(node->chld + 1);
+	node->h->heap = NODE_HEAP_END(db->pool->page_size);
 	node->h->page = page;
 	return 0;
 }
 
+/**
+ * Compare two keys of arbitrary length (memcmp order, shorter key is less).
+ *
+ * Common prefix is compared in fixed-width chunks of 32 (AVX2) or 16 (SSE2)
+ * bytes, stopping on the first differing byte. Tail is left to memcmp.
+ */
+static inline int node_key_mem_cmp(const char *a, size_t a_len,
+				   const char *b, size_t b_len) {
+	size_t len = (a_len < b_len ? a_len : b_len);
+	size_t i = 0;
+#if defined(__AVX2__)
+	for (; i + 32 <= len; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (eq != 0xFFFFFFFFu) {
+			int off = __builtin_ctz(~eq);
+			return (int )(unsigned char )a[i + off] -
+			       (int )(unsigned char )b[i + off];
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if (eq != 0xFFFF) {
+			int off = __builtin_ctz(~eq);
+			return (int )(unsigned char )a[i + off] -
+			       (int )(unsigned char )b[i + off];
+		}
+	}
+#endif
+	int cmp = memcmp(a + i, b + i, len - i);
+	if (cmp) return cmp;
+	return (a_len > b_len) - (a_len < b_len);
+}
+
+/**
+ * @brief     Compare two keys (memcmp order, shorter key is less)
+ *
+ * @return    <0, 0, >0 like memcmp(a, b)
+ */
+int node_key_cmp_raw(const void *a, size_t a_len, const void *b, size_t b_len) {
+	return node_key_mem_cmp(a, a_len, b, b_len);
+}
+
+/**
+ * @brief     Compare key at position pos with the given key
+ *
+ * @param node    Node to search in
+ * @param pos     Position of key in the node
+ * @param key     Key to compare with
+ * @param key_len Length of key
+ *
+ * @return    <0, 0, >0 like memcmp(NODE_KEY_POS(node, pos), key)
+ */
+int node_key_cmp(struct BTreeNode *node, size_t pos,
+		 const void *key, size_t key_len) {
+	return node_key_mem_cmp(NODE_KEY_POS(node, pos), NODE_KEY_LEN(node, pos),
+				key, key_len);
+}
+
+/**
+ * First 4 bytes of the key as big-endian integer (zero padded), so heads
+ * compare in the same order, as keys do.
+ */
+static inline uint32_t node_key_head(const void *key, size_t key_len) {
+	const unsigned char *k = key;
+	uint32_t head = 0;
+	size_t i = 0;
+	for (i = 0; i < sizeof(uint32_t); ++i)
+		head = (head << 8) | (i < key_len ? k[i] : 0);
+	return head;
+}
+
+/**
+ * @brief      Binary search of key in the node
+ *
+ * @param[in]  node    Node to search in
+ * @param[in]  key     Key to search for
+ * @param[in]  key_len Length of key
+ * @param[out] cmp     Result of comparison of key at returned position with
+ *                     the given key (0 on exact match, -1 if position is out
+ *                     of node)
+ *
+ * @return     Position of the first key, that isn't less than given one
+ */
+size_t node_key_search(struct BTreeNode *node, const void *key,
+		       size_t key_len, int *cmp) {
+	uint32_t head = node_key_head(key, key_len);
+	size_t lo = 0, hi = node->h->size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		uint32_t mid_head = NODE_SLOT(node, mid)->head;
+		int c = (mid_head > head) - (mid_head < head);
+		if (c == 0)
+			c = node_key_cmp(node, mid, key, key_len);
+		if (c < 0) {
+			lo = mid + 1;
+		} else if (c > 0) {
+			hi = mid;
+		} else {
+			*cmp = 0;
+			return mid;
+		}
+	}
+	*cmp = (lo < node->h->size ? 1 : -1);
+	return lo;
+}
+
+/**
+ * @brief      Position of the child of internal node, which subtree may
+ *             hold the key
+ */
+size_t node_key_child(struct BTreeNode *node, const void *key, size_t key_len) {
+	int cmp = 0;
+	size_t pos = node_key_search(node, key, key_len, &cmp);
+	return (cmp == 0 ? pos + 1 : pos);
+}
+
+/**
+ * Offset of the end of slot directory
+ */
+static inline size_t node_btree_dir_end(struct BTreeNode *node) {
+	return (char *)NODE_SLOT(node, node->h->size) - (char *)node->h;
+}
+
+/**
+ * @brief  Space, used by slots and keys of the node
+ */
+size_t node_btree_used(struct DB *db, struct BTreeNode *node) {
+	return node->h->size * sizeof(struct NodeSlot) +
+	       (NODE_HEAP_END(db->pool->page_size) - node->h->heap - node->h->frag);
+}
+
+/**
+ * @brief  Space, available for new slots and keys in the node
+ */
+size_t node_btree_free(struct DB *db, struct BTreeNode *node) {
+	return db->node_capacity - node_btree_used(db, node);
+}
+
+/**
+ * Move all records to the end of page, squeezing out holes of removed keys
+ */
+static void node_btree_compact(struct DB *db, struct BTreeNode *node) {
+	uint16_t end  = NODE_HEAP_END(db->pool->page_size);
+	uint16_t heap = end;
+	char buf[end];
+	size_t pos = 0;
+	for (pos = 0; pos < node->h->size; ++pos) {
+		size_t size = NODE_REC_SIZE(NODE_REC_LEN(node, pos));
+		heap -= size;
+		memcpy(buf + heap, NODE_REC(node, pos), size);
+		NODE_SLOT(node, pos)->off = heap;
+	}
+	memcpy((char *)node->h + heap, buf + heap, end - heap);
+	node->h->heap = heap;
+	node->h->frag = 0;
+}
+
+/**
+ * Reserve len bytes in the heap (and keep space for `slots` new slots)
+ */
+static uint16_t node_btree_heap_alloc(struct DB *db, struct BTreeNode *node,
+				      size_t len, size_t slots) {
+	size_t need = len + slots * sizeof(struct NodeSlot);
+	if (node->h->heap - node_btree_dir_end(node) < need)
+		node_btree_compact(db, node);
+	assert(node->h->heap - node_btree_dir_end(node) >= need);
+	node->h->heap -= len;
+	return node->h->heap;
+}
+
+/**
+ * Insert record into the node at position pos. Value is inlined if data
+ * isn't NULL (val is ignored then), otherwise vflags tell the kind of val
+ * (0 for DataNode page, SLOT_BLOB or SLOT_PACKED).
+ */
+static int node_btree_insert_rec(struct DB *db, struct BTreeNode *node,
+				 size_t pos, const void *key, size_t key_len,
+				 pageno_t val, pageno_t chld, uint16_t vflags,
+				 const void *data, size_t data_len) {
+	size_t rec_len = key_len + (data ? data_len : 0);
+	check(node_btree_free(db, node) >= NODE_ENTRY_SIZE(rec_len),
+	      "No space for key in node %zd", node->h->page);
+	node_write(db, node);
+	uint16_t off = node_btree_heap_alloc(db, node, NODE_REC_SIZE(rec_len), 1);
+	struct NodeRecord *rec = (struct NodeRecord *)((char *)node->h + off);
+	rec->chld = chld;
+	rec->val  = (data ? (pageno_t )data_len : val);
+	memcpy(rec->key, key, key_len);
+	if (data) memcpy(rec->key + key_len, data, data_len);
+	memmove(NODE_SLOT(node, pos + 1), NODE_SLOT(node, pos),
+		(node->h->size - pos) * sizeof(struct NodeSlot));
+	struct NodeSlot *slot = NODE_SLOT(node, pos);
+	slot->head = node_key_head(key, key_len);
+	slot->off  = off;
+	slot->len  = key_len | (data ? SLOT_INLINE : vflags);
+	node->h->size += 1;
+	return 0;
+error:
+	return -1;
+}
+
+/**
+ * @brief  Insert key into the node at position pos
+ *
+ * @param db      Current Database instance
+ * @param node    Node to insert into
+ * @param pos     Position of new key
+ * @param key     Key (mustn't point into the same node)
+ * @param key_len Length of key
+ * @param val     Data page of the key
+ * @param chld    Child to the right of the key
+ *
+ * @return Status (-1 if there's no space for the key)
+ */
+int node_btree_insert(struct DB *db, struct BTreeNode *node, size_t pos,
+		      const void *key, size_t key_len,
+		      pageno_t val, pageno_t chld) {
+	return node_btree_insert_rec(db, node, pos, key, key_len,
+				     val, chld, 0, NULL, 0);
+}
+
+/**
+ * @brief  Insert copy of key (and it's value) at position spos of the node
+ *         src into the node dst at position dpos
+ *
+ * @param chld Child to the right of the new key
+ *
+ * @return Status (-1 if there's no space for the key)
+ */
+int node_btree_copy(struct DB *db, struct BTreeNode *dst, size_t dpos,
+		    struct BTreeNode *src, size_t spos, pageno_t chld) {
+	size_t rec_len = NODE_REC_LEN(src, spos);
+	size_t key_len = NODE_KEY_LEN(src, spos);
+	int    inl     = NODE_INLINE(src, spos);
+	pageno_t val   = NODE_VAL(src, spos);
+	char buf[rec_len + 1];
+	memcpy(buf, NODE_KEY_POS(src, spos), rec_len);
+	return node_btree_insert_rec(db, dst, dpos, buf, key_len, val, chld,
+				     NODE_VFLAGS(src, spos),
+				     inl ? buf + key_len : NULL,
+				     rec_len - key_len);
+}
+
+/**
+ * @brief  Remove key (with it's value and right child) at position pos
+ */
+void node_btree_remove(struct DB *db, struct BTreeNode *node, size_t pos) {
+	node_write(db, node);
+	node->h->frag += NODE_REC_SIZE(NODE_REC_LEN(node, pos));
+	memmove(NODE_SLOT(node, pos), NODE_SLOT(node, pos + 1),
+		(node->h->size - pos - 1) * sizeof(struct NodeSlot));
+	node->h->size -= 1;
+	if (node->h->size == 0) node_btree_truncate(db, node, 0);
+}
+
+/**
+ * @brief  Replace key and value at position pos with the ones at position
+ *         spos of the node src (child is preserved)
+ *
+ * @return Status (-1 if there's no space for the key)
+ */
+int node_btree_replace(struct DB *db, struct BTreeNode *node, size_t pos,
+		       struct BTreeNode *src, size_t spos) {
+	check(node_btree_free(db, node) +
+	      NODE_ENTRY_SIZE(NODE_REC_LEN(node, pos)) >=
+	      NODE_ENTRY_SIZE(NODE_REC_LEN(src, spos)),
+	      "No space for key in node %zd", node->h->page);
+	pageno_t chld = NODE_CHLD(node, pos + 1);
+	node_btree_remove(db, node, pos);
+	return node_btree_copy(db, node, pos, src, spos, chld);
+error:
+	return -1;
+}
+
+/**
+ * @brief  Replace value of key at position pos (key and child are preserved)
+ *
+ * @param val      Data page of the key
+ * @param vflags   SLOT_BLOB if val is the first page of a blob, SLOT_PACKED
+ *                 if it's the packed value, 0 otherwise
+ * @param data     Value to store inline (or NULL)
+ * @param data_len Length of data
+ *
+ * @return Status (-1 if there's no space for the value)
+ */
+int node_btree_set_val(struct DB *db, struct BTreeNode *node, size_t pos,
+		       pageno_t val, uint16_t vflags,
+		       const void *data, size_t data_len) {
+	size_t key_len = NODE_KEY_LEN(node, pos);
+	if (node_btree_free(db, node) + NODE_ENTRY_SIZE(NODE_REC_LEN(node, pos)) <
+	    NODE_ENTRY_SIZE(key_len + (data ? data_len : 0)))
+		return -1;
+	char     key[key_len + 1];
+	pageno_t chld = NODE_CHLD(node, pos + 1);
+	memcpy(key, NODE_KEY_POS(node, pos), key_len);
+	node_btree_remove(db, node, pos);
+	return node_btree_insert_rec(db, node, pos, key, key_len,
+				     val, chld, vflags, data, data_len);
+}
+
+/**
+ * @brief  Replace separator at position pos of internal node with the key
+ *         (child is preserved)
+ *
+ * @return Status (-1 if there's no space for the key)
+ */
+int node_btree_set_key(struct DB *db, struct BTreeNode *node, size_t pos,
+		       const void *key, size_t key_len) {
+	if (node_btree_free(db, node) + NODE_ENTRY_SIZE(NODE_REC_LEN(node, pos)) <
+	    NODE_ENTRY_SIZE(key_len))
+		return -1;
+	char     buf[key_len + 1];
+	pageno_t chld = NODE_CHLD(node, pos + 1);
+	memcpy(buf, key, key_len);
+	node_btree_remove(db, node, pos);
+	return node_btree_insert(db, node, pos, buf, key_len, 0, chld);
+}
+
+/**
+ * @brief  Drop all keys starting from position size
+ */
+void node_btree_truncate(struct DB *db, struct BTreeNode *node, size_t size) {
+	size_t pos = 0;
+	node_write(db, node);
+	for (pos = size; pos < node->h->size; ++pos)
+		node->h->frag += NODE_REC_SIZE(NODE_REC_LEN(node, pos));
+	node->h->size = size;
+	if (size == 0) {
+		node->h->heap = NODE_HEAP_END(db->pool->page_size);
+		node->h->frag = 0;
+	}
+}
+
+/**
+ * @brief  Append count keys (with values and right children) of node src
+ *         starting from position from to the node dst
+ */
+int node_btree_append(struct DB *db, struct BTreeNode *dst,
+		      struct BTreeNode *src, size_t from, size_t count) {
+	size_t pos = 0;
+	for (pos = from; pos < from + count; ++pos) {
+		if (node_btree_copy(db, dst, dst->h->size, src, pos,
+				    NODE_CHLD(src, pos + 1)) == -1)
+			return -1;
+	}
+	return 0;
+}
+
 /**
  * @brief      Initialize data node (cached version)
  *
@@ -37,11 +438,34 @@ int node_btree_load(struct DB *db, struct BTreeNode *node, pageno_t page) {
  * @return     Status
  */
 int node_data_load(struct DB *db, struct DataNode *node, pageno_t page) {
-	int page_new = (page == 0 ? 1 : 0);
-	if (page_new) page = pool_alloc(db->pool);
+	if (page == 0)
+		return node_data_create(db, node, 0);
 	node->h = (struct NodeHeader *)cache_page_get(db->pool->cache, page);
 	node->data = (void *)node->h + sizeof(struct NodeHeader);
-	if (page_new) memset(node->h, 0, db->pool->page_size);
+	if (node->h->page != page || !(node->h->flags & IS_DATA)) {
+		node->h->page   = page;
+		node->h->flags |= IS_DATA;
+	}
+	return 0;
+}
+
+/**
+ * @brief      Create new data node (cached version)
+ *
+ * @param[in]  db   Current Database instance
+ * @param[out] node Node for initialization
+ * @param[in]  near Page, new node should be placed after (0 if any page
+ *                  will do), e.g. leaf, holding the value
+ *
+ * @return     Status (-1 if there's no space in the pool)
+ */
+int node_data_create(struct DB *db, struct DataNode *node, pageno_t near) {
+	pageno_t page = pool_alloc_near(db->pool, near, 1);
+	if (page == 0)
+		return -1;
+	node->h = (struct NodeHeader *)cache_page_get(db->pool->cache, page);
+	node->data = (void *)node->h + sizeof(struct NodeHeader);
+	memset(node->h, 0, db->pool->page_size);
 	node->h->page = page;
 	node->h->flags = IS_DATA;
 	return 0;
@@ -59,8 +483,11 @@ int node_btree_dump(struct DB *db, struct BTreeNode *node) {
 	log_info("Dumping BTreeNode %zd", node->h->page);
 	wal_write_append(db, node->h->page);
 	node->h->lsn = (db->lsn)++;
-
-	node->h->flags |= CACHE_DIRTY;
+	struct CacheElem *elem = cachei_page_get(db->pool->cache, node->h->page);
+	if (elem)
+		cachei_flag_set(elem, CACHE_DIRTY);
+	else
+		log_err("can't find");
 	return 0;
 }
 
@@ -78,7 +505,7 @@ int node_data_dump(struct DB *db, struct DataNode *node) {
 	node->h->lsn = (db->lsn)++;
 	struct CacheElem *elem = cachei_page_get(db->pool->cache, node->h->page);
 	if (elem)
-		elem->flag |= CACHE_DIRTY;
+		cachei_flag_set(elem, CACHE_DIRTY);
 	else
 		log_err("can't find");
 	return 0;
@@ -96,6 +523,45 @@ int node_deallocate(struct DB *db, pageno_t pos) {
 	return pool_dealloc(db->pool, pos);
 }
 
+/**
+ * @brief      Move node (of any kind, that lives in the cache) into the first
+ *             empty page of the pool, if there's one before it's page, and
+ *             free the page. References to the node are fixed by caller.
+ *
+ * @param db   DB object
+ * @param page Page of the node (node mustn't be loaded)
+ *
+ * @return     New page of the node (page, if node isn't moved)
+ */
+pageno_t node_relocate(struct DB *db, pageno_t page) {
+	pageno_t to = pool_alloc_before(db->pool, page, 1);
+	if (to == 0)
+		return page;
+	log_info("Moving node %zd to %zd", page, to);
+	struct DataNode src, dst;
+	src.h = (struct NodeHeader *)cache_page_get(db->pool->cache, page);
+	dst.h = (struct NodeHeader *)cache_page_get(db->pool->cache, to);
+	memcpy(dst.h, src.h, db->pool->page_size);
+	dst.h->page = to;
+	node_data_dump(db, &dst);
+	node_free(db, &dst);
+	node_free(db, &src);
+	node_deallocate(db, page);
+	return to;
+}
+
+/**
+ * @brief      Node is going to be changed: it's before-image is kept for
+ *             the WAL record (see cache_page_write). Changes, made by
+ *             node_btree_* functions, don't need it.
+ *
+ * @param db   DB object
+ * @param node (void *)(struct DataNode *) or (void *)(struct BTreeNode *)
+ */
+void node_write(struct DB *db, void *node) {
+	cache_page_write(db->pool->cache, ((struct BTreeNode *)(node))->h->page);
+}
+
 /**
  * @brief      Return node to cache
  *
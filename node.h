@@ -4,10 +4,44 @@
 #include "btree.h"
 
 int  node_btree_load (struct DB *db, struct BTreeNode *node, pageno_t page);
+int  node_btree_create(struct DB *db, struct BTreeNode *node, pageno_t near);
+int  node_btree_init (struct DB *db, struct BTreeNode *node, void *buf,
+		      pageno_t page);
 int  node_data_load  (struct DB *db, struct DataNode *node, pageno_t page);
+int  node_data_create(struct DB *db, struct DataNode *node, pageno_t near);
 int  node_btree_dump (struct DB *db, struct BTreeNode *node);
 int  node_data_dump  (struct DB *db, struct DataNode *node);
 int  node_deallocate (struct DB *db, pageno_t pos);
+pageno_t node_relocate(struct DB *db, pageno_t page);
+void node_write      (struct DB *db, void *node);
 void node_free       (struct DB *db, void *node);
 
+int    node_key_cmp_raw(const void *a, size_t a_len,
+			const void *b, size_t b_len);
+int    node_key_cmp   (struct BTreeNode *node, size_t pos,
+		       const void *key, size_t key_len);
+size_t node_key_search(struct BTreeNode *node, const void *key,
+		       size_t key_len, int *cmp);
+size_t node_key_child (struct BTreeNode *node, const void *key,
+		       size_t key_len);
+
+size_t node_btree_used    (struct DB *db, struct BTreeNode *node);
+size_t node_btree_free    (struct DB *db, struct BTreeNode *node);
+int    node_btree_insert  (struct DB *db, struct BTreeNode *node, size_t pos,
+			   const void *key, size_t key_len,
+			   pageno_t val, pageno_t chld);
+int    node_btree_copy    (struct DB *db, struct BTreeNode *dst, size_t dpos,
+			   struct BTreeNode *src, size_t spos, pageno_t chld);
+void   node_btree_remove  (struct DB *db, struct BTreeNode *node, size_t pos);
+int    node_btree_replace (struct DB *db, struct BTreeNode *node, size_t pos,
+			   struct BTreeNode *src, size_t spos);
+int    node_btree_set_val (struct DB *db, struct BTreeNode *node, size_t pos,
+			   pageno_t val, uint16_t vflags,
+			   const void *data, size_t data_len);
+int    node_btree_set_key (struct DB *db, struct BTreeNode *node, size_t pos,
+			   const void *key, size_t key_len);
+void   node_btree_truncate(struct DB *db, struct BTreeNode *node, size_t size);
+int    node_btree_append  (struct DB *db, struct BTreeNode *dst,
+			   struct BTreeNode *src, size_t from, size_t count);
+
 #endif /* _BTREE_NODE_H_ */
@@ -0,0 +1,249 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "lz.h"
+#include "node.h"
+#include "pack.h"
+
+/*
+ * Packed values (see struct PackSlot). New values go to the current pack
+ * page (db->pack) while it has room, otherwise a new page is started.
+ * Values are compressed, when it makes them shorter, and decompressed,
+ * when they are read, so the cache keeps pages compressed too.
+ */
+
+#define PACK_DIR(NODE)     ((struct PackSlot *)(NODE)->data)
+#define PACK_DIR_END(NODE) (sizeof(struct NodeHeader) +                \
+			    (NODE)->h->size * sizeof(struct PackSlot))
+
+/*
+ * Largest value, that may be packed (alone in the page)
+ */
+static inline size_t packi_capacity(struct DB *db) {
+	return db->pool->page_size - sizeof(struct NodeHeader) -
+	       sizeof(struct PackSlot);
+}
+
+/*
+ * Bytes, left for a value (with a new slot for it) in the page
+ */
+static inline size_t packi_room(struct DataNode *node) {
+	size_t room = node->h->heap - PACK_DIR_END(node) + node->h->frag;
+	return (room > sizeof(struct PackSlot) ? room - sizeof(struct PackSlot) : 0);
+}
+
+/*
+ * Move all values to the end of page, squeezing out holes of freed ones
+ */
+static void packi_compact(struct DB *db, struct DataNode *node) {
+	uint16_t end  = db->pool->page_size;
+	uint16_t heap = end;
+	char buf[end];
+	size_t pos = 0;
+	for (pos = 0; pos < node->h->size; ++pos) {
+		struct PackSlot *slot = &PACK_DIR(node)[pos];
+		if (slot->len == 0)
+			continue;
+		heap -= slot->len;
+		memcpy(buf + heap, (char *)node->h + slot->off, slot->len);
+		slot->off = heap;
+	}
+	memcpy((char *)node->h + heap, buf + heap, end - heap);
+	node->h->heap = heap;
+	node->h->frag = 0;
+}
+
+/*
+ * Put value into the page
+ * Returns slot of the value (-1 if there's no room)
+ */
+static int packi_put(struct DB *db, struct DataNode *node, const void *data,
+		     size_t len, size_t raw) {
+	size_t pos = 0;
+	while (pos < node->h->size && PACK_DIR(node)[pos].len > 0)
+		pos++;
+	if (pos == PACK_SLOTS_MAX)
+		return -1;
+	size_t need = len + (pos == node->h->size ? sizeof(struct PackSlot) : 0);
+	size_t gap  = node->h->heap - PACK_DIR_END(node);
+	if (gap < need && gap + node->h->frag < need)
+		return -1;
+	node_write(db, node);
+	if (gap < need)
+		packi_compact(db, node);
+	if (pos == node->h->size)
+		node->h->size++;
+	node->h->heap -= len;
+	memcpy((char *)node->h + node->h->heap, data, len);
+	PACK_DIR(node)[pos].off = node->h->heap;
+	PACK_DIR(node)[pos].len = len;
+	PACK_DIR(node)[pos].raw = raw;
+	return pos;
+}
+
+/*
+ * Put stored (maybe compressed) value into the current pack page or into
+ * the new one
+ */
+static int packi_store(struct DB *db, pageno_t near, const void *data,
+		       size_t len, size_t raw, pageno_t *ref) {
+	struct DataNode node;
+	int    slot = -1;
+	size_t room = 0;
+	if (db->pack) {
+		node_data_load(db, &node, db->pack);
+		slot = packi_put(db, &node, data, len, raw);
+		if (slot == -1) {
+			room = packi_room(&node);
+			node_free(db, &node);
+		}
+	}
+	if (slot == -1) {
+		if (node_data_create(db, &node, near) == -1)
+			return -1;
+		node.h->flags |= IS_PACKED;
+		node.h->heap   = db->pool->page_size;
+		slot = packi_put(db, &node, data, len, raw);
+		check(slot != -1, "Can't pack value of %zd bytes", len);
+		/* Page with more room is kept for the next values */
+		if (db->pack == 0 || packi_room(&node) > room)
+			db->pack = node.h->page;
+	}
+	log_info("Packed %zd bytes into %zd bytes (page %zd, slot %d)",
+		 raw, len, node.h->page, slot);
+	*ref = PACK_REF(node.h->page, (pageno_t )slot);
+	node_data_dump(db, &node);
+	node_free(db, &node);
+	return 0;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief  Pack value into the shared data page
+ *
+ * @param near Page, new pack page should be placed after (e.g. leaf)
+ * @param ref  Reference to the value (see PACK_REF)
+ *
+ * @return Status (-1 if value is too big to be packed or there's no space
+ *         in the pool)
+ */
+int pack_write(struct DB *db, pageno_t near, const void *val, size_t val_len,
+	       pageno_t *ref) {
+	size_t cap = packi_capacity(db);
+	char   buf[cap];
+	const void *data = val;
+	size_t len = val_len;
+	/* Compressed value is kept only if it's shorter */
+	if (val_len > 1) {
+		size_t clen = lz_compress(val, val_len, buf,
+					  val_len <= cap ? val_len - 1 : cap);
+		if (clen > 0) {
+			data = buf;
+			len  = clen;
+		}
+	}
+	if (len > cap)
+		return -1;
+	return packi_store(db, near, data, len, val_len, ref);
+}
+
+/*
+ * Load page of the packed value
+ * Returns slot of the value
+ */
+static struct PackSlot *packi_load(struct DB *db, struct DataNode *node,
+				   pageno_t ref) {
+	node_data_load(db, node, PACK_PAGE(ref));
+	check((node->h->flags & IS_PACKED) && PACK_SLOT(ref) < node->h->size &&
+	      PACK_DIR(node)[PACK_SLOT(ref)].len > 0,
+	      "There's no packed value %zd", ref);
+	return &PACK_DIR(node)[PACK_SLOT(ref)];
+error:
+	exit(-1);
+}
+
+/**
+ * @brief  Copy packed value into newly allocated memory
+ *
+ * @return Status
+ */
+int pack_read(struct DB *db, pageno_t ref, void **val, size_t *val_len) {
+	struct DataNode  node;
+	struct PackSlot *slot = packi_load(db, &node, ref);
+	char            *data = (char *)node.h + slot->off;
+	*val_len = slot->raw;
+	*val = malloc(*val_len + 1);
+	check_mem(*val, *val_len + 1);
+	if (slot->len == slot->raw)
+		memcpy(*val, data, *val_len);
+	else
+		check(lz_decompress(data, slot->len, *val, *val_len) ==
+		      (ssize_t )*val_len, "Packed value %zd is corrupted", ref);
+	((char *)*val)[*val_len] = 0;
+	node_free(db, &node);
+	return 0;
+error:
+	exit(-1);
+}
+
+/*
+ * Free slot of the loaded page (and the page, if it was the last one there)
+ */
+static int packi_remove(struct DB *db, struct DataNode *node,
+			struct PackSlot *slot) {
+	pageno_t page = node->h->page;
+	node_write(db, node);
+	node->h->frag += slot->len;
+	slot->len = 0;
+	slot->off = 0;
+	while (node->h->size > 0 && PACK_DIR(node)[node->h->size - 1].len == 0)
+		node->h->size--;
+	if (node->h->size == 0) {
+		if (db->pack == page)
+			db->pack = 0;
+		node_free(db, node);
+		return node_deallocate(db, page);
+	}
+	node_data_dump(db, node);
+	node_free(db, node);
+	return 0;
+}
+
+/**
+ * @brief  Free packed value (and it's page, if it was the last one there)
+ *
+ * @return Status
+ */
+int pack_free(struct DB *db, pageno_t ref) {
+	struct DataNode  node;
+	struct PackSlot *slot = packi_load(db, &node, ref);
+	return packi_remove(db, &node, slot);
+}
+
+/**
+ * @brief  Move packed value out of the page, that is less than half full,
+ *         into the current pack page (as it is, without recompression), so
+ *         sparse pages are emptied and freed (see db_vacuum)
+ *
+ * @param[in,out] ref Reference to the value
+ *
+ * @return 1 if value is moved, 0 otherwise
+ */
+int pack_compact(struct DB *db, pageno_t *ref) {
+	struct DataNode  node;
+	struct PackSlot *slot = packi_load(db, &node, *ref);
+	if (node.h->page == db->pack ||
+	    packi_room(&node) + sizeof(struct PackSlot) < packi_capacity(db) / 2) {
+		node_free(db, &node);
+		return 0;
+	}
+	size_t len = slot->len, raw = slot->raw;
+	char   buf[len];
+	memcpy(buf, (char *)node.h + slot->off, len);
+	packi_remove(db, &node, slot);
+	/* New page goes to the first empty page, not to the tail */
+	packi_store(db, 0, buf, len, raw, ref);
+	return 1;
+}
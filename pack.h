@@ -0,0 +1,12 @@
+#ifndef _BTREE_PACK_H_
+#define _BTREE_PACK_H_
+
+#include "btree.h"
+
+int pack_write(struct DB *db, pageno_t near, const void *val, size_t val_len,
+	       pageno_t *ref);
+int pack_read (struct DB *db, pageno_t ref, void **val, size_t *val_len);
+int pack_free (struct DB *db, pageno_t ref);
+int pack_compact(struct DB *db, pageno_t *ref);
+
+#endif /* _BTREE_PACK_H_ */
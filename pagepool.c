@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /* O_DIRECT */
+
 #include "pagepool.h"
 #include "cache.h"
 #include "dbg.h"       /* log_err
@@ -6,9 +8,7 @@
 #include <bit.h>       /* bit_set
 			* bit_test
 			* bit_clear
-			* struct bit_iterator
-			* bit_iterator_init
-			* bit_iterator_next
+			* bit_ctz_u64
 			*/
 #include <math.h>      /* ceil */
 #include <errno.h>     /* strerror
@@ -16,10 +16,20 @@
 			*/
 #include <stdlib.h>    /* malloc
 			* calloc
+			* posix_memalign
 			*/
 #include <assert.h>    /* assert */
+#include <string.h>    /* memcpy */
 #include <unistd.h>    /* pread
 			* pwrite
+			* ftruncate
+			*/
+#include <sys/uio.h>   /* preadv
+			* pwritev
+			*/
+#include <sys/mman.h>  /* mmap
+			* msync
+			* munmap
 			*/
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -31,11 +41,19 @@
 	#define malloc( calloc(1,
 #endif
 
-static int preallocateFile(int fd, uint64_t length) {
+/*
+ * Returns 0 on success, -1 (with errno set) on failure
+ */
+static int preallocateFile(int fd, uint64_t offset, uint64_t length) {
 #ifdef HAVE_FALLOCATE
-	return fallocate( fd, 0, offset, length );
+	return (fallocate( fd, 0, offset, length ) == 0 ? 0 : -1);
 #elif defined(__linux__)
-	return posix_fallocate( fd, 0, length );
+	/* posix_fallocate returns the error instead of setting errno */
+	int err = posix_fallocate( fd, offset, length );
+	if (err == 0)
+		return 0;
+	errno = err;
+	return -1;
 #elif defined(__APPLE__)
 	fstore_t fst;
 	fst.fst_flags = F_ALLOCATEALL;
@@ -43,7 +61,7 @@ static int preallocateFile(int fd, uint64_t length) {
 	fst.fst_offset = 0;
 	fst.fst_length = length;
 	fst.fst_bytesalloc = 0;
-	return fcntl(fd, F_PREALLOCATE, &fst);
+	return (fcntl(fd, F_PREALLOCATE, &fst) == -1 ? -1 : 0);
 #else
 	# warning no known method to preallocate files on this platform
 	return -1;
@@ -56,24 +74,183 @@ static int preallocateFile(int fd, uint64_t length) {
  */
 static inline pageno_t bitmask_pages(struct PagePool *pp) {
 	pageno_t ans = pp->page_size * CHAR_BIT;
-	ans = ceil(((double )pp->nPages) / ans);
+	ans = ceil(((double )pp->maxPages) / ans);
 	return ans;
 }
 
+/*
+ * Index over the bitmap: bit w of the level 1 is set, if word w of the
+ * bitmap (level 0) isn't zero, bit w of the level l - if word w of the
+ * level l-1 isn't zero. Set bit is found with one ctz per level, change of
+ * the bit updates at most one word per level.
+ *
+ * Pool keeps two of them: free pages (bitmap is the bitmask, read as 64-bit
+ * little-endian words and inverted) and fully empty extents (bitmap of it's
+ * own, bit per extent), so both free page and empty extent are found in
+ * O(levels).
+ */
+
+/**
+ * Number of bits in the bitmap of the index
+ */
+static inline size_t summary_bits(struct PagePool *pp, struct PoolIndex *ix) {
+	return (ix == &pp->pages ? pp->nPages : pp->nPages / POOL_EXTENT);
+}
+
+/**
+ * Number of words on the level l of the index
+ */
+static inline size_t summary_words(struct PagePool *pp, struct PoolIndex *ix,
+				   size_t l) {
+	size_t words = (summary_bits(pp, ix) + 63) / 64;
+	for (; l > 0; --l) words = (words + 63) / 64;
+	return words;
+}
+
+/**
+ * Word w of the level l. On level 0 of the page index set bits are free
+ * pages.
+ */
+static inline uint64_t summary_word(struct PagePool *pp, struct PoolIndex *ix,
+				    size_t l, size_t w) {
+	if (l > 0 || ix != &pp->pages)
+		return ix->level[l][w];
+	uint64_t word = ~((uint64_t *)pp->bitmask)[w];
+	if ((w + 1) * 64 > (size_t )pp->nPages) /* Bits past the end of pool */
+		word &= (1ULL << (pp->nPages % 64)) - 1;
+	return word;
+}
+
+/**
+ * Update index after bit pos of the bitmap has changed
+ */
+static void summary_update(struct PagePool *pp, struct PoolIndex *ix,
+			   size_t pos) {
+	size_t w = pos / 64, l = 0;
+	for (l = 1; l <= ix->levels; ++l, w /= 64) {
+		uint64_t *word = &ix->level[l][w / 64];
+		uint64_t  was  = *word;
+		if (summary_word(pp, ix, l - 1, w))
+			*word |= 1ULL << (w % 64);
+		else
+			*word &= ~(1ULL << (w % 64));
+		if ((*word != 0) == (was != 0))
+			break;
+	}
+}
+
+/**
+ * Extent e has no used pages
+ */
+static inline bool extent_empty(struct PagePool *pp, size_t e) {
+	const uint64_t mask = (POOL_EXTENT < 64 ? (1ULL << POOL_EXTENT) : 0) - 1;
+	pageno_t first = e * POOL_EXTENT;
+	/* Extent never crosses the word (POOL_EXTENT divides 64) */
+	return (summary_word(pp, &pp->pages, 0, first / 64) >> (first % 64) &
+		mask) == mask;
+}
+
+/**
+ * Update empty extent index after page pos has changed
+ */
+static void extent_update(struct PagePool *pp, pageno_t pos) {
+	size_t e = pos / POOL_EXTENT;
+	if (e >= summary_bits(pp, &pp->extents))
+		return;
+	uint64_t *word = &pp->extents.level[0][e / 64];
+	uint64_t  was  = *word;
+	if (extent_empty(pp, e))
+		*word |= 1ULL << (e % 64);
+	else
+		*word &= ~(1ULL << (e % 64));
+	if (*word != was)
+		summary_update(pp, &pp->extents, e);
+}
+
+/**
+ * Free levels of the index
+ */
+static void summary_free(struct PoolIndex *ix) {
+	size_t l = 0;
+	for (l = 0; l <= POOL_SUMMARY_LEVELS; ++l) {
+		free(ix->level[l]);
+		ix->level[l] = NULL;
+	}
+	ix->levels = 0;
+}
+
 /**
- * Init byte iterator
+ * Build index from the bitmap (bitmap of empty extents - from the bitmask)
  */
-static int bitmask_it_init(struct PagePool *pp) {
-	if (!pp->it)
-		pp->it = (struct bit_iterator *)malloc(sizeof(struct bit_iterator));
-	check_mem(pp->it, sizeof(struct bit_iterator));
-	bit_iterator_init(pp->it, (const void *)pp->bitmask,
-			  pp->page_size*pp->nPages, false);
+static int summary_build(struct PagePool *pp, struct PoolIndex *ix) {
+	size_t l = 0, w = 0;
+	summary_free(ix);
+	while (ix->levels < POOL_SUMMARY_LEVELS &&
+	       summary_words(pp, ix, ix->levels) > 1)
+		ix->levels++;
+	if (ix != &pp->pages) {
+		size_t words = summary_words(pp, ix, 0);
+		ix->level[0] = calloc(words ? words : 1, sizeof(uint64_t));
+		check_mem(ix->level[0], words * sizeof(uint64_t));
+		for (w = 0; w < summary_bits(pp, ix); ++w)
+			if (extent_empty(pp, w))
+				ix->level[0][w / 64] |= 1ULL << (w % 64);
+	}
+	for (l = 1; l <= ix->levels; ++l) {
+		ix->level[l] = calloc(summary_words(pp, ix, l), sizeof(uint64_t));
+		check_mem(ix->level[l], summary_words(pp, ix, l) * sizeof(uint64_t));
+		for (w = 0; w < summary_words(pp, ix, l - 1); ++w)
+			if (summary_word(pp, ix, l - 1, w))
+				ix->level[l][w / 64] |= 1ULL << (w % 64);
+	}
 	return 0;
 error:
 	exit(-1);
 }
 
+/**
+ * Build both indexes (after the bitmask is loaded or size of pool changed)
+ */
+static void pooli_index_build(struct PagePool *pp) {
+	summary_build(pp, &pp->pages);
+	summary_build(pp, &pp->extents);
+}
+
+/**
+ * First set bit of the bitmap, starting from the bit pos
+ * Returns 0 when there's no such bit
+ */
+static size_t summary_find(struct PagePool *pp, struct PoolIndex *ix,
+			   size_t pos) {
+	size_t l = 0;
+	/* Go up, until word with set bit after pos is found */
+	while (1) {
+		if (pos / 64 >= summary_words(pp, ix, l))
+			return 0;
+		uint64_t word = summary_word(pp, ix, l, pos / 64) & (~0ULL << (pos % 64));
+		if (word) {
+			pos = pos - pos % 64 + bit_ctz_u64(word);
+			break;
+		}
+		if (l == ix->levels)
+			return 0;
+		pos = pos / 64 + 1;
+		l++;
+	}
+	/* And down to the set bit */
+	for (; l > 0; --l)
+		pos = pos * 64 + bit_ctz_u64(summary_word(pp, ix, l - 1, pos));
+	return pos;
+}
+
+/**
+ * First free page, starting from the page pos
+ * Returns 0 when there's no such page
+ */
+static inline pageno_t pooli_find_free(struct PagePool *pp, pageno_t pos) {
+	return summary_find(pp, &pp->pages, pos);
+}
+
 /**
  * Dump bitmask pages to the disk
  */
@@ -86,6 +263,45 @@ error:
 	exit(-1);
 }
 
+/**
+ * Mark page as used (or free), bitmask page holding it's bit as changed
+ */
+static inline void bitmask_mark(struct PagePool *pp, pageno_t pos, int used) {
+	if (used)
+		bit_set(pp->bitmask, pos);
+	else
+		bit_clear(pp->bitmask, pos);
+	pp->bitmask_dirty[pos / (pp->page_size * CHAR_BIT)] = 1;
+	summary_update(pp, &pp->pages, pos);
+	extent_update(pp, pos);
+}
+
+/**
+ * @brief    Write bitmask pages, changed since the last flush, to the disk.
+ *           Allocation of the single page isn't written at once: the page
+ *           gets into the WAL, when it's dumped, so the bit is recovered
+ *           from there (see wal_recover).
+ *
+ * @param pp PagePool instance
+ *
+ * @return   Status
+ */
+int pool_bitmask_flush(struct PagePool *pp) {
+	pageno_t i = 0;
+	for (i = 0; i < bitmask_pages(pp); ++i) {
+		if (!pp->bitmask_dirty[i])
+			continue;
+		pp->bitmask_dirty[i] = 0;
+		log_info("Dump bitmask page %zd", i);
+		ssize_t retval = pwrite(pp->fd, (char *)pp->bitmask + i * pp->page_size,
+					pp->page_size, i * pp->page_size);
+		check_diskpw(retval, (size_t )pp->page_size, i);
+	}
+	return 0;
+error:
+	exit(-1);
+}
+
 /**
  * Load bitmask pages from the disk
  */
@@ -93,7 +309,7 @@ static inline ssize_t bitmask_load(struct PagePool *pp) {
 	log_info("Load bitmask");
 	ssize_t retval = pread(pp->fd, pp->bitmask, pp->page_size * bitmask_pages(pp), 0);
 	check_diskr(retval, pp->page_size * bitmask_pages(pp));
-	bitmask_it_init(pp);
+	pooli_index_build(pp);
 	return retval;
 error:
 	exit(-1);
@@ -114,19 +330,124 @@ static int bitmask_init(struct PagePool *pp) {
 	pageno_t pagenum = bitmask_pages(pp);
 	while (pagenum > 0) bit_set(pp->bitmask, --pagenum);
 	bitmask_dump(pp);
-	bitmask_it_init(pp);
+	pooli_index_build(pp);
+	return 0;
+}
+
+/**
+ * Find the first run of count empty pages, starting from the page pos
+ * (the longest one, if there's no such run). Used pages between runs are
+ * skipped by the index.
+ * Returns 0 when there're no empty pages
+ */
+static pageno_t pooli_find_run(struct PagePool *pp, pageno_t pos,
+			       pageno_t count, pageno_t *got) {
+	pageno_t best = 0, best_len = 0;
+	pos = pooli_find_free(pp, pos);
+	while (pos != 0 && best_len < count) {
+		pageno_t len = 1;
+		while (len < count && pos + len < pp->nPages &&
+		       !bitmask_check(pp, pos + len))
+			++len;
+		if (len > best_len) {
+			best     = pos;
+			best_len = len;
+		}
+		pos = pooli_find_free(pp, pos + len);
+	}
+	*got = best_len;
+	return best;
+}
+
+/**
+ * Find the first extent (POOL_EXTENT aligned empty pages), starting from
+ * the page pos. Extent 0 holds the bitmask, so it's never empty.
+ * Returns 0 when there's no such extent
+ */
+static inline pageno_t pooli_find_extent(struct PagePool *pp, pageno_t pos) {
+	size_t e = (pos + POOL_EXTENT - 1) / POOL_EXTENT;
+	return (pageno_t )summary_find(pp, &pp->extents, e) * POOL_EXTENT;
+}
+
+/**
+ * Empty page of the extent, holding the page pos, after pos
+ * Returns 0 when there's no such page
+ */
+static inline pageno_t pooli_extent_find(struct PagePool *pp, pageno_t pos) {
+	pageno_t found = pooli_find_free(pp, pos + 1);
+	return (found / POOL_EXTENT == pos / POOL_EXTENT ? found : 0);
+}
+
+/**
+ * Extend the file by at least count pages (by the grow chunk, if it's
+ * larger), but not past the space, bitmask is reserved for. New pages are
+ * empty, index is rebuilt to cover them.
+ */
+static int pooli_grow(struct PagePool *pp, pageno_t count) {
+	if (pp->nPages >= pp->maxPages)
+		return -1;
+	pageno_t size = pp->nPages + (count > pp->grow ? count : pp->grow);
+	if (size > pp->maxPages)
+		size = pp->maxPages;
+	log_info("Growing pool from %zd to %zd pages", pp->nPages, size);
+	check(preallocateFile(pp->fd, (uint64_t )pp->nPages * pp->page_size,
+			      (uint64_t )(size - pp->nPages) * pp->page_size) == 0,
+	      "Can't grow pool to %zd pages", size);
+	pp->nPages = size;
+	pooli_index_build(pp);
 	return 0;
+error:
+	return -1;
 }
 
 /**
- * Find empty page
- * Returns 0 when can't find empty page
+ * Pages, pool must grow by to get the new aligned extent
  */
-static pageno_t page_find_empty(struct PagePool *pp) {
-	pageno_t pos = bit_iterator_next(pp->it);
-	if (pos == SIZE_MAX) bitmask_it_init(pp);
-	pos = bit_iterator_next(pp->it);
-	return (pos == SIZE_MAX ? 0 : pos);
+static inline pageno_t pooli_extent_room(struct PagePool *pp) {
+	return (POOL_EXTENT - pp->nPages % POOL_EXTENT) % POOL_EXTENT + POOL_EXTENT;
+}
+
+/**
+ * @brief       Find empty page near the given one and reserve it. Pages are
+ *              grouped by extents of POOL_EXTENT pages: empty page after
+ *              near in it's extent is taken. If there's none, new fully
+ *              empty extent is started, so pages, wanted near the new one
+ *              later, are placed right after it. Spilled pages go to the
+ *              shared spill extent instead, that's filled sequentially.
+ *              When no extent is empty, pool grows by one. Without near
+ *              (or room to grow) the first empty page of the pool is taken.
+ *
+ * @param pp    PagePool instance
+ * @param near  Page, new page should be placed after (0 if any page will do)
+ * @param spill Page doesn't need an extent of it's own, when near's extent
+ *              is full (e.g. data page of the leaf)
+ *
+ * @return      number of allocated page (0 if there're no empty pages)
+ */
+pageno_t pool_alloc_near(struct PagePool *pp, pageno_t near, int spill) {
+	pageno_t pos = 0;
+	if (near > 0) {
+		pos = pooli_extent_find(pp, near);
+		if (pos == 0 && spill && pp->extent > 0)
+			pos = pooli_extent_find(pp, pp->extent);
+		if (pos == 0) {
+			pos = pooli_find_extent(pp, spill ? pp->extent : near);
+			if (pos == 0)
+				pos = pooli_find_extent(pp, 0);
+			if (pos == 0 && pooli_grow(pp, pooli_extent_room(pp)) == 0)
+				pos = pooli_find_extent(pp, 0);
+			if (spill)
+				pp->extent = pos;
+		}
+	}
+	if (pos == 0)
+		pos = pooli_find_free(pp, 0);
+	if (pos == 0 && pooli_grow(pp, 1) == 0)
+		pos = pooli_find_free(pp, 0);
+	if (pos == 0) return 0;
+	log_info("Allocating page %zd", pos);
+	bitmask_mark(pp, pos, 1);
+	return pos;
 }
 
 /**
@@ -137,12 +458,73 @@ static pageno_t page_find_empty(struct PagePool *pp) {
  * @return   number of allocated page
  */
 pageno_t pool_alloc(struct PagePool *pp) {
-	pageno_t pos = page_find_empty(pp);
-	if (pos == -1) return 0;
-	log_info("Allocating page %zd", pos);
-	bit_set(pp->bitmask, pos);
-	bitmask_dump(pp);
-	return pos;
+	return pool_alloc_near(pp, 0, 0);
+}
+
+/**
+ * @brief       Reserve run of adjacent empty pages. The first run of count
+ *              pages is taken, if there's no such run - the longest one.
+ *
+ * @param pp    PagePool instance
+ * @param count Wanted number of pages
+ * @param got   Number of pages, actually reserved
+ *
+ * @return      First page of the run (0 if there're no empty pages)
+ */
+pageno_t pool_alloc_run(struct PagePool *pp, pageno_t count, pageno_t *got) {
+	pageno_t best_len = 0;
+	pageno_t best = pooli_find_run(pp, 0, count, &best_len), pos = 0;
+	if (best_len < count && pooli_grow(pp, count) == 0)
+		best = pooli_find_run(pp, 0, count, &best_len);
+	*got = best_len;
+	if (best_len == 0) return 0;
+	log_info("Allocating pages %zd-%zd", best, best + best_len - 1);
+	for (pos = best; pos < best + best_len; ++pos)
+		bitmask_mark(pp, pos, 1);
+	/* Runs are written bypassing the WAL, so they're persisted at once */
+	pool_bitmask_flush(pp);
+	return best;
+}
+
+/**
+ * @brief       Reserve the first run of count empty pages, if it starts
+ *              before the page pos, so content of pos may be moved closer
+ *              to the start of the pool (see db_vacuum)
+ *
+ * @param pp    PagePool instance
+ * @param pos   Page (run), that is going to be moved
+ * @param count Number of pages in the run
+ *
+ * @return      First page of the run (0 if there's no such run)
+ */
+pageno_t pool_alloc_before(struct PagePool *pp, pageno_t pos, pageno_t count) {
+	pageno_t got = 0;
+	pageno_t run = pooli_find_run(pp, 0, count, &got), i = 0;
+	if (run == 0 || got < count || run >= pos)
+		return 0;
+	log_info("Allocating pages %zd-%zd before %zd", run, run + count - 1, pos);
+	for (i = run; i < run + count; ++i)
+		bitmask_mark(pp, i, 1);
+	return run;
+}
+
+/**
+ * @brief       Free run of pages, reserved by pool_alloc_run
+ *
+ * @param pp    PagePool instance
+ * @param pos   First page of the run
+ * @param count Number of pages in the run
+ *
+ * @return      Status
+ */
+int pool_dealloc_run(struct PagePool *pp, pageno_t pos, pageno_t count) {
+	log_info("Freeing pages %zd-%zd", pos, pos + count - 1);
+	pageno_t end = pos + count;
+	for (; pos < end; ++pos) {
+		if (!bitmask_check(pp, pos)) return -1;
+		bitmask_mark(pp, pos, 0);
+	}
+	return 0;
 }
 
 /**
@@ -155,10 +537,219 @@ pageno_t pool_alloc(struct PagePool *pp) {
  */
 int pool_dealloc(struct PagePool *pp, pageno_t pos) {
 	log_info("Freeing page %zd", pos);
-	if (bitmask_check(pp, pos)) return -1;
-	bit_clear(pp->bitmask, pos);
-	bitmask_dump(pp);
+	if (pos < bitmask_pages(pp) || pos >= pp->nPages ||
+	    !bitmask_check(pp, pos)) return -1;
+	bitmask_mark(pp, pos, 0);
+	return 0;
+}
+
+/**
+ * @brief     Check, that page is allocated (freed page keeps it's cached
+ *            copy, which is stale, when the page is taken again)
+ *
+ * @param pp  PagePool instance
+ * @param pos Number of page
+ *
+ * @return    1 if page is used, 0 otherwise
+ */
+int pool_page_used(struct PagePool *pp, pageno_t pos) {
+	return pos >= bitmask_pages(pp) && pos < pp->nPages &&
+	       bitmask_check(pp, pos);
+}
+
+/**
+ * @brief     Mark page as used (while recovering allocations from the WAL)
+ *
+ * @param pp  PagePool instance
+ * @param pos Number of page
+ *
+ * @return    Status
+ */
+int pool_reserve(struct PagePool *pp, pageno_t pos) {
+	check(pos > 0 && pos < pp->maxPages, "Page %zd is out of pool", pos);
+	/* Page was written past the end, that is lost (e.g. by the crash) */
+	if (pos >= pp->nPages && pooli_grow(pp, pos + 1 - pp->nPages) == -1)
+		return -1;
+	if (bitmask_check(pp, pos)) return 0;
+	log_info("Recovering allocation of page %zd", pos);
+	bitmask_mark(pp, pos, 1);
+	return 0;
+error:
+	return -1;
+}
+
+/**
+ * @brief    Cut empty pages off the end of the file (it grows back, when
+ *           they're needed again). Cached copies of these pages are
+ *           dropped, so they're never written past the new end.
+ *
+ * @param pp PagePool instance
+ *
+ * @return   Number of pages, file is shrunk by
+ */
+pageno_t pool_truncate(struct PagePool *pp) {
+	pageno_t size = pp->nPages, pos = 0;
+	while (size > bitmask_pages(pp) && !bitmask_check(pp, size - 1))
+		--size;
+	if (size == pp->nPages)
+		return 0;
+	log_info("Truncating pool from %zd to %zd pages", pp->nPages, size);
+	for (pos = size; pos < pp->nPages; ++pos)
+		cache_page_drop(pp->cache, pos);
+	/* Tail must be free on the disk, before it's gone */
+	pool_bitmask_flush(pp);
+	check(ftruncate(pp->fd, (off_t )size * pp->page_size) == 0,
+	      "Can't truncate pool to %zd pages", size);
+	pos = pp->nPages - size;
+	pp->nPages = size;
+	if (pp->extent + POOL_EXTENT > size)
+		pp->extent = 0;
+	pooli_index_build(pp);
+	return pos;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief    Map pool file into memory. Pages are read and written by copying
+ *           from (into) the mapping afterwards, without a syscall per page.
+ *           Mapping covers the maximum size of the pool, so growing the file
+ *           doesn't move it. Changes are written back by pool_sync.
+ *
+ * @param pp PagePool instance
+ *
+ * @return   Status
+ */
+int pool_map(struct PagePool *pp) {
+	size_t size = (size_t )pp->maxPages * pp->page_size;
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pp->fd, 0);
+	check(map != MAP_FAILED, "Can't map pool file (%zd bytes)", size);
+	/* Tree pages are accessed at random, readahead only wastes memory */
+	madvise(map, size, MADV_RANDOM);
+	pp->map = map;
+	return 0;
+error:
+	return -1;
+}
+
+/**
+ * @brief      Start (or wait for) write back of the mapped pool. Does nothing
+ *             for the pool, that isn't mapped.
+ *
+ * @param pp   PagePool instance
+ * @param wait Wait until pages are on the disk
+ *
+ * @return     Status
+ */
+int pool_sync(struct PagePool *pp, int wait) {
+	if (!pp->map)
+		return 0;
+	int retval = msync(pp->map, (size_t )pp->nPages * pp->page_size,
+			   wait ? MS_SYNC : MS_ASYNC);
+	check(retval != -1, "Failed to sync pool mapping");
 	return 0;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief     Page of the mapped pool
+ *
+ * @param pp  PagePool instance
+ * @param pos Page number
+ *
+ * @return    Pointer to the page in the mapping (NULL if pool isn't mapped)
+ */
+void *pool_page(struct PagePool *pp, pageno_t pos) {
+	if (!pp->map)
+		return NULL;
+	assert(pos < pp->nPages);
+	return (char *)pp->map + (size_t )pos * pp->page_size;
+}
+
+/**
+ * @brief    Alignment of page buffers (the largest power of two, dividing
+ *           page size), so they may be used for O_DIRECT I/O
+ */
+size_t pool_align(struct PagePool *pp) {
+	size_t align = pp->page_size & -pp->page_size;
+	return (align < sizeof(void *) ? sizeof(void *) : align);
+}
+
+/**
+ * @brief       Allocate zeroed buffer for count pages, aligned by pool_align
+ *
+ * @return      Buffer (to be freed by free)
+ */
+void *pool_page_alloc(struct PagePool *pp, size_t count) {
+	void *buf = NULL;
+	check(posix_memalign(&buf, pool_align(pp), count * pp->page_size) == 0,
+	      "Failed to allocate %zd bytes", count * pp->page_size);
+	memset(buf, 0, count * pp->page_size);
+	return buf;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief      Open pool file once more with O_DIRECT: pages, read (written)
+ *             whole from the aligned buffer (i.e. cache frames), bypass the
+ *             kernel page cache. Other I/O is still buffered, kernel keeps
+ *             both views coherent. Does nothing, if filesystem (or page
+ *             size) doesn't allow direct I/O.
+ *
+ * @param pp   PagePool instance
+ * @param name Name of the pool file
+ *
+ * @return     Status (-1 if direct I/O isn't used)
+ */
+int pool_direct(struct PagePool *pp, char *name) {
+	int fd = open(name, O_RDWR | O_DIRECT);
+	if (fd == -1) {
+		log_info("O_DIRECT isn't supported for '%s'", name);
+		return -1;
+	}
+	/* Device may need larger alignment, than the page has */
+	void *probe = pool_page_alloc(pp, 1);
+	if (pread(fd, probe, pp->page_size, 0) != pp->page_size) {
+		log_info("Direct I/O with page size %d isn't possible", pp->page_size);
+		free(probe);
+		close(fd);
+		return -1;
+	}
+	free(probe);
+	pp->dfd = fd;
+	return 0;
+}
+
+/**
+ * @brief      Descriptor for I/O of size bytes at offset of the page from
+ *             (to) buf: direct one, if it's possible
+ */
+int pool_page_fd(struct PagePool *pp, const void *buf, size_t size,
+		 size_t offset) {
+	if (pp->dfd && size == pp->page_size && offset == 0 &&
+	    (uintptr_t )buf % pool_align(pp) == 0)
+		return pp->dfd;
+	return pp->fd;
+}
+
+/*
+ * Copy iov from (into) the mapped pool, starting at page pos
+ */
+static ssize_t pooli_map_copy(struct PagePool *pp, const struct iovec *iov,
+			      int iovcnt, pageno_t pos, size_t offset, int write) {
+	char *addr = (char *)pool_page(pp, pos) + offset;
+	ssize_t size = 0;
+	int i = 0;
+	for (i = 0; i < iovcnt; ++i) {
+		if (write)
+			memcpy(addr + size, iov[i].iov_base, iov[i].iov_len);
+		else
+			memcpy(iov[i].iov_base, addr + size, iov[i].iov_len);
+		size += iov[i].iov_len;
+	}
+	return size;
 }
 
 /**
@@ -172,7 +763,12 @@ int pool_dealloc(struct PagePool *pp, pageno_t pos) {
  */
 int pool_read(struct PagePool *pp, pageno_t pos, void *buffer) {
 	log_info("Reading Node %zd into buffer", pos);
-	ssize_t retval = pread(pp->fd, buffer, pp->page_size, pos * pp->page_size);
+	if (pp->map) {
+		memcpy(buffer, pool_page(pp, pos), pp->page_size);
+		return 0;
+	}
+	ssize_t retval = pread(pool_page_fd(pp, buffer, pp->page_size, 0),
+			       buffer, pp->page_size, pos * pp->page_size);
 	check_diskpr(retval, pp->page_size, pos);
 	return 0;
 error:
@@ -192,7 +788,12 @@ error:
 int pool_write(struct PagePool *pp, void *data, size_t size,
 	       pageno_t pos, size_t offset) {
 	assert(size + offset <= pp->page_size);
-	ssize_t retval = pwrite(pp->fd, data, size, pos * pp->page_size + offset);
+	if (pp->map) {
+		memcpy((char *)pool_page(pp, pos) + offset, data, size);
+		return size;
+	}
+	ssize_t retval = pwrite(pool_page_fd(pp, data, size, offset),
+				data, size, pos * pp->page_size + offset);
 	check_diskpw(retval, pp->page_size, pos);
 	log_info("written");
 	return retval;
@@ -200,6 +801,57 @@ error:
 	exit(-1);
 }
 
+/**
+ * @brief        Read bytes, starting from page pos, into several buffers
+ *
+ * @param pp     PagePool instance
+ * @param iov    Buffers
+ * @param iovcnt Number of buffers
+ * @param pos    First page to be read
+ * @param offset Offset in the first page
+ *
+ * @return       Number of bytes read
+ */
+ssize_t pool_readv(struct PagePool *pp, const struct iovec *iov, int iovcnt,
+		   pageno_t pos, size_t offset) {
+	size_t size = 0;
+	int i = 0;
+	for (i = 0; i < iovcnt; ++i) size += iov[i].iov_len;
+	if (pp->map)
+		return pooli_map_copy(pp, iov, iovcnt, pos, offset, 0);
+	ssize_t retval = preadv(pp->fd, iov, iovcnt, pos * pp->page_size + offset);
+	check_diskpr(retval, size, pos);
+	return retval;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief        Write several buffers to disk, starting from page pos
+ *
+ * @param pp     PagePool instance
+ * @param iov    Buffers
+ * @param iovcnt Number of buffers
+ * @param pos    First page to be written
+ * @param offset Offset in the first page
+ *
+ * @return       Number of bytes written
+ */
+ssize_t pool_writev(struct PagePool *pp, const struct iovec *iov, int iovcnt,
+		    pageno_t pos, size_t offset) {
+	size_t size = 0;
+	int i = 0;
+	for (i = 0; i < iovcnt; ++i) size += iov[i].iov_len;
+	assert(pos * pp->page_size + offset + size <=
+	       (size_t )pp->nPages * pp->page_size);
+	if (pp->map)
+		return pooli_map_copy(pp, iov, iovcnt, pos, offset, 1);
+	ssize_t retval = pwritev(pp->fd, iov, iovcnt, pos * pp->page_size + offset);
+	check_diskpw(retval, size, pos);
+	return retval;
+error:
+	exit(-1);
+}
 
 /**
  * @brief      Initialize PagePool object
@@ -207,16 +859,19 @@ error:
  * @param[out] pp       PagePool object to instanciate
  * @param[in]  name     Name of file to be used for storage
  * @param[in]  page_size Size of page
- * @param[in]  pool_size Size of file
+ * @param[in]  pool_size Maximum size of file
+ * @param[in]  pool_grow Size of chunk, file grows by (0 - file isn't grown)
  *
  * @return     Status
  */
 static int pooli_init(struct PagePool *pp, char *name, uint16_t page_size,
-	              pageno_t pool_size, size_t cache_size) {
+	              pageno_t pool_size, size_t pool_grow, size_t cache_size) {
 	memset(pp, 0, sizeof(struct PagePool));
 	pp->page_size = page_size;
 	pp->pool_size = pool_size;
-	pp->nPages = ceil(pool_size/page_size);
+	pp->maxPages = ceil(pool_size/page_size);
+	pp->nPages = pp->maxPages;
+	pp->grow = pool_grow / page_size;
 
 	pp->cache = (struct CacheBase *)malloc(sizeof(struct CacheBase));
 	check_mem(pp->cache, sizeof(struct CacheBase));
@@ -224,19 +879,31 @@ static int pooli_init(struct PagePool *pp, char *name, uint16_t page_size,
 
 	pp->bitmask = (void *)calloc(bitmask_pages(pp) * pp->page_size, 1);
 	check_mem(pp->bitmask, bitmask_pages(pp) * pp->page_size);
+	pp->bitmask_dirty = (uint8_t *)calloc(bitmask_pages(pp), 1);
+	check_mem(pp->bitmask_dirty, bitmask_pages(pp));
 
 	return 0;
 error:
 	exit(-1);
 }
 
+/**
+ * @brief      Create pool file. Space for the bitmask of the whole pool_size
+ *             is reserved, but only the first chunk of pages is allocated,
+ *             the rest is allocated, when it's needed.
+ *
+ * @return     Status
+ */
 int pool_init_new(struct PagePool *pp, char *name, uint16_t page_size,
-	          pageno_t pool_size, size_t cache_size) {
-	pooli_init(pp, name, page_size, pool_size, cache_size);
+	          pageno_t pool_size, size_t pool_grow, size_t cache_size) {
+	pooli_init(pp, name, page_size, pool_size, pool_grow, cache_size);
+	if (pp->grow > 0 && bitmask_pages(pp) + pp->grow < pp->maxPages)
+		pp->nPages = bitmask_pages(pp) + pp->grow;
 
 	pp->fd = open(name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
 	check(pp->fd != -1, "Can't open file '%s' for read/write", name);
-	check(preallocateFile(pp->fd, pool_size) != -1, "Can't preallocate file '%s'", name);
+	check(preallocateFile(pp->fd, 0, (uint64_t )pp->nPages * page_size) == 0,
+	      "Can't preallocate file '%s'", name);
 
 	bitmask_init(pp);
 	return 0;
@@ -244,12 +911,22 @@ error:
 	exit(-1);
 }
 
+/**
+ * @brief      Open existing pool file. Number of pages is taken from the
+ *             size of the file.
+ *
+ * @return     Status
+ */
 int pool_init_old(struct PagePool *pp, char *name, uint16_t page_size,
-	          pageno_t pool_size, size_t cache_size) {
-	pooli_init(pp, name, page_size, pool_size, cache_size);
+	          pageno_t pool_size, size_t pool_grow, size_t cache_size) {
+	pooli_init(pp, name, page_size, pool_size, pool_grow, cache_size);
 
 	pp->fd = open(name, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
 	check(pp->fd != -1, "Can't open file '%s' for read/write", name);
+	struct stat st;
+	check(fstat(pp->fd, &st) != -1, "Can't stat file '%s'", name);
+	if ((pageno_t )(st.st_size / page_size) < pp->maxPages)
+		pp->nPages = st.st_size / page_size;
 
 	bitmask_load(pp);
 	return 0;
@@ -265,6 +942,17 @@ error:
  * @return   Status
  */
 int pool_free(struct PagePool *pp) {
+	if (pp->fd && pp->bitmask_dirty)
+		pool_bitmask_flush(pp);
+	if (pp->dfd) {
+		close(pp->dfd);
+		pp->dfd = 0;
+	}
+	if (pp->map) {
+		pool_sync(pp, 1);
+		munmap(pp->map, (size_t )pp->maxPages * pp->page_size);
+		pp->map = NULL;
+	}
 	if (pp->fd) {
 		pp->fd = close(pp->fd);
 		check(pp->fd != -1, "Failed to close file descriptor for PagePool");
@@ -274,10 +962,12 @@ int pool_free(struct PagePool *pp) {
 		free(pp->bitmask);
 		pp->bitmask = NULL;
 	}
-	if (pp->it) {
-		free(pp->it);
-		pp->it = NULL;
+	if (pp->bitmask_dirty) {
+		free(pp->bitmask_dirty);
+		pp->bitmask_dirty = NULL;
 	}
+	summary_free(&pp->pages);
+	summary_free(&pp->extents);
 	if (pp->cache) {
 		cache_free(pp->cache);
 		free(pp->cache);
@@ -1,26 +1,42 @@
 #ifndef   PAGEPOOL_H
 #define   PAGEPOOL_H
 
+#include <sys/uio.h>
+
 #include "btree.h"
 
 /*
 pageno_t bitmask_pages   (struct PagePool *);
-int      bitmask_it_init (struct PagePool *);
 int      bitmask_dump    (struct PagePool *);
 int      bitmask_load    (struct PagePool *);
 int      bitmask_populate(struct PagePool *);
 int      bitmask_check   (struct PagePool *, pageno_t);
-
-pageno_t page_find_empty(struct PagePool *);
 */
 
 pageno_t pool_alloc  (struct PagePool *);
+pageno_t pool_alloc_near (struct PagePool *, pageno_t, int);
 int      pool_dealloc(struct PagePool *, pageno_t);
+int      pool_reserve(struct PagePool *, pageno_t);
+int      pool_page_used(struct PagePool *, pageno_t);
+int      pool_bitmask_flush(struct PagePool *);
+pageno_t pool_alloc_run  (struct PagePool *, pageno_t, pageno_t *);
+int      pool_dealloc_run(struct PagePool *, pageno_t, pageno_t);
+pageno_t pool_alloc_before(struct PagePool *, pageno_t, pageno_t);
+pageno_t pool_truncate   (struct PagePool *);
 int      pool_read   (struct PagePool *, pageno_t, void *);
 int      pool_write  (struct PagePool *, void *, size_t, pageno_t, size_t);
+ssize_t  pool_readv  (struct PagePool *, const struct iovec *, int, pageno_t, size_t);
+ssize_t  pool_writev (struct PagePool *, const struct iovec *, int, pageno_t, size_t);
+int      pool_map    (struct PagePool *);
+int      pool_sync   (struct PagePool *, int);
+void    *pool_page   (struct PagePool *, pageno_t);
+int      pool_direct (struct PagePool *, char *);
+size_t   pool_align  (struct PagePool *);
+void    *pool_page_alloc(struct PagePool *, size_t);
+int      pool_page_fd(struct PagePool *, const void *, size_t, size_t);
 int      pool_init   (struct PagePool *, char *, uint16_t, pageno_t, size_t);
 int      pool_free   (struct PagePool *);
 
-int      pool_init_old   (struct PagePool *, char *, uint16_t, pageno_t, size_t);
-int      pool_init_new   (struct PagePool *, char *, uint16_t, pageno_t, size_t);
+int      pool_init_old   (struct PagePool *, char *, uint16_t, pageno_t, size_t, size_t);
+int      pool_init_new   (struct PagePool *, char *, uint16_t, pageno_t, size_t, size_t);
 #endif /* PAGEPOOL_H */
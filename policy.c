@@ -0,0 +1,285 @@
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "cache.h"
+
+#include <uthash.h>
+#include <utlist.h>
+
+/*
+ * Scan resistant replacement policies (see struct CachePolicy). Both keep
+ * frames in LRU lists - pages, that are got once (T1), and pages, that are
+ * got again (T2), - and remember pages, evicted lately (ghosts). Page,
+ * that is read again while it's remembered, goes straight to T2, so the
+ * scan, reading every page once, evicts pages of T1 only.
+ *
+ * 2Q:  T1 is A1in (FIFO), T2 is Am (LRU), B1 is A1out. T1 is kept about
+ *      a quarter of the shard, A1out remembers half of the shard.
+ * ARC: T1 and T2 are LRU, B1 and B2 remember pages evicted from them.
+ *      Target size of T1 (p) grows on hits in B1 and shrinks on hits in
+ *      B2, so the policy adapts to the workload.
+ *
+ * Pages, that are prefetched, aren't counted as got, until they're got
+ * (see CACHE_REF).
+ */
+
+#define POLICY_FREE 1 /* Frames without page */
+#define POLICY_T1   2
+#define POLICY_T2   3
+#define POLICY_B1   0 /* Ghost lists */
+#define POLICY_B2   1
+
+struct PolicyList {
+	struct CacheElem *head; /* Most recent frame (head->lprev is the least) */
+	size_t            size;
+};
+
+struct PolicyGhost {
+	pageno_t page;
+	int      list;
+	struct PolicyGhost *prev, *next;
+	UT_hash_handle hh;
+};
+
+struct PolicyGhostList {
+	struct PolicyGhost *head;
+	size_t              size;
+};
+
+struct PolicyState {
+	struct PolicyList      lists[4];  /* Indexed by CacheElem.list */
+	struct PolicyGhostList ghost[2];
+	struct PolicyGhost    *ghosts;    /* HashTable of both ghost lists */
+	struct PolicyGhost    *spare;     /* Free ghosts */
+	size_t                 p;         /* Target size of T1 (ARC) */
+};
+
+static inline struct PolicyState *policyi_state(struct CacheShard *shard) {
+	return (struct PolicyState *)shard->policy;
+}
+
+static inline size_t policyi_size(struct CacheShard *shard, int list) {
+	return policyi_state(shard)->lists[list].size;
+}
+
+static void policyi_push(struct CacheShard *shard, int list,
+			 struct CacheElem *elem) {
+	struct PolicyList *l = &policyi_state(shard)->lists[list];
+	DL_PREPEND2(l->head, elem, lprev, lnext);
+	elem->list = list;
+	l->size++;
+}
+
+static void policyi_remove(struct CacheShard *shard, struct CacheElem *elem) {
+	struct PolicyList *l = &policyi_state(shard)->lists[elem->list];
+	if (elem->list == 0)
+		return;
+	DL_DELETE2(l->head, elem, lprev, lnext);
+	elem->lprev = elem->lnext = NULL;
+	elem->list  = 0;
+	l->size--;
+}
+
+/*
+ * The least recent frame of the list, that isn't busy (or NULL)
+ */
+static struct CacheElem *policyi_lru(struct CacheShard *shard, int list) {
+	struct CacheElem *head = policyi_state(shard)->lists[list].head;
+	struct CacheElem *elem = (head ? head->lprev : NULL);
+	for (; elem; elem = (elem == head ? NULL : elem->lprev))
+		if (!cachei_frame_busy(elem))
+			return elem;
+	return NULL;
+}
+
+static struct PolicyGhost *policyi_ghost_find(struct CacheShard *shard,
+					      pageno_t page) {
+	struct PolicyGhost *ghost = NULL;
+	HASH_FIND(hh, policyi_state(shard)->ghosts, &page, sizeof(pageno_t), ghost);
+	return ghost;
+}
+
+static void policyi_ghost_remove(struct CacheShard *shard,
+				 struct PolicyGhost *ghost) {
+	struct PolicyState *state = policyi_state(shard);
+	DL_DELETE(state->ghost[ghost->list].head, ghost);
+	state->ghost[ghost->list].size--;
+	HASH_DEL(state->ghosts, ghost);
+	ghost->next  = state->spare;
+	state->spare = ghost;
+}
+
+/*
+ * Forget the least recent ghosts of the list, until there're max of them
+ */
+static void policyi_ghost_trim(struct CacheShard *shard, int list, size_t max) {
+	struct PolicyGhostList *l = &policyi_state(shard)->ghost[list];
+	while (l->size > max)
+		policyi_ghost_remove(shard, l->head->prev);
+}
+
+static void policyi_ghost_add(struct CacheShard *shard, int list,
+			      pageno_t page) {
+	struct PolicyState *state = policyi_state(shard);
+	struct PolicyGhost *ghost = policyi_ghost_find(shard, page);
+	if (ghost)
+		policyi_ghost_remove(shard, ghost);
+	if ((ghost = state->spare)) {
+		state->spare = ghost->next;
+	} else {
+		ghost = malloc(sizeof(struct PolicyGhost));
+		check_mem(ghost, sizeof(struct PolicyGhost));
+	}
+	ghost->page = page;
+	ghost->list = list;
+	DL_PREPEND(state->ghost[list].head, ghost);
+	state->ghost[list].size++;
+	HASH_ADD(hh, state->ghosts, page, sizeof(pageno_t), ghost);
+	return;
+error:
+	exit(-1);
+}
+
+/*
+ * Evict the page of the frame from the list (remembering it in the ghost
+ * list, if it's given), frame goes to the new page
+ */
+static struct CacheElem *policyi_evict(struct CacheShard *shard,
+				       struct CacheElem *elem, int ghost) {
+	policyi_remove(shard, elem);
+	if (ghost != -1) {
+		policyi_ghost_add(shard, ghost, elem->id);
+		policyi_ghost_trim(shard, ghost, shard->frames);
+	}
+	return elem;
+}
+
+static int policy_init(struct CacheShard *shard) {
+	shard->policy = calloc(1, sizeof(struct PolicyState));
+	check_mem(shard->policy, sizeof(struct PolicyState));
+	return 0;
+error:
+	return -1;
+}
+
+static void policy_free(struct CacheShard *shard) {
+	struct PolicyState *state = policyi_state(shard);
+	struct PolicyGhost *ghost = NULL;
+	policyi_ghost_trim(shard, POLICY_B1, 0);
+	policyi_ghost_trim(shard, POLICY_B2, 0);
+	while ((ghost = state->spare)) {
+		state->spare = ghost->next;
+		free(ghost);
+	}
+	free(state);
+	shard->policy = NULL;
+}
+
+static void policy_add(struct CacheShard *shard, struct CacheElem *elem) {
+	policyi_push(shard, POLICY_FREE, elem);
+}
+
+static void policy_drop(struct CacheShard *shard, struct CacheElem *elem) {
+	policyi_remove(shard, elem);
+	policyi_push(shard, POLICY_FREE, elem);
+}
+
+/*
+ * Page, that is remembered, is got again - it goes to T2, others go to T1
+ */
+static void policy_admit(struct CacheShard *shard, struct CacheElem *elem) {
+	struct PolicyGhost *ghost = policyi_ghost_find(shard, elem->id);
+	if (ghost)
+		policyi_ghost_remove(shard, ghost);
+	policyi_push(shard, (ghost ? POLICY_T2 : POLICY_T1), elem);
+}
+
+/*
+ * 2Q: page of A1in stays there (it's got once per scan), page of Am is
+ * the most recent again
+ */
+static void q2_hit(struct CacheShard *shard, struct CacheElem *elem) {
+	if (elem->list != POLICY_T2 || !(elem->flag & CACHE_REF))
+		return;
+	policyi_remove(shard, elem);
+	policyi_push(shard, POLICY_T2, elem);
+}
+
+static struct CacheElem *q2_victim(struct CacheShard *shard, pageno_t page) {
+	size_t kin = shard->frames / 4 + 1;
+	struct CacheElem *elem = NULL;
+	if ((elem = policyi_lru(shard, POLICY_FREE)))
+		return policyi_evict(shard, elem, -1);
+	if (policyi_size(shard, POLICY_T1) > kin &&
+	    (elem = policyi_lru(shard, POLICY_T1)))
+		return policyi_evict(shard, elem, POLICY_B1);
+	if ((elem = policyi_lru(shard, POLICY_T2)))
+		return policyi_evict(shard, elem, -1);
+	if ((elem = policyi_lru(shard, POLICY_T1)))
+		return policyi_evict(shard, elem, POLICY_B1);
+	return NULL;
+}
+
+/*
+ * A1out remembers half of the shard
+ */
+static void q2_admit(struct CacheShard *shard, struct CacheElem *elem) {
+	policy_admit(shard, elem);
+	policyi_ghost_trim(shard, POLICY_B1, shard->frames / 2 + 1);
+}
+
+const struct CachePolicy cache_policy_2q = {
+	"2q", policy_init, policy_free, policy_add, q2_hit, q2_victim,
+	q2_admit, policy_drop
+};
+
+/*
+ * ARC: page, that is got again, is the most recent one of T2
+ */
+static void arc_hit(struct CacheShard *shard, struct CacheElem *elem) {
+	if (!(elem->flag & CACHE_REF))
+		return;
+	policyi_remove(shard, elem);
+	policyi_push(shard, POLICY_T2, elem);
+}
+
+static struct CacheElem *arc_victim(struct CacheShard *shard, pageno_t page) {
+	struct PolicyState *state = policyi_state(shard);
+	struct PolicyGhost *ghost = policyi_ghost_find(shard, page);
+	size_t c  = shard->frames;
+	size_t t1 = policyi_size(shard, POLICY_T1);
+	size_t b1 = state->ghost[POLICY_B1].size;
+	size_t b2 = state->ghost[POLICY_B2].size;
+	struct CacheElem *elem = NULL;
+	int    in_b2 = (ghost && ghost->list == POLICY_B2);
+	/* Adapt target of T1 to the ghost hit */
+	if (ghost && ghost->list == POLICY_B1) {
+		state->p += (b2 > b1 ? b2 / b1 : 1);
+		if (state->p > c)
+			state->p = c;
+	} else if (in_b2) {
+		size_t delta = (b1 > b2 ? b1 / b2 : 1);
+		state->p = (state->p > delta ? state->p - delta : 0);
+	} else if (t1 + b1 >= c && b1 > 0) {
+		policyi_ghost_trim(shard, POLICY_B1, b1 - 1);
+	} else if (t1 + b1 + policyi_size(shard, POLICY_T2) + b2 >= 2 * c &&
+		   b2 > 0) {
+		policyi_ghost_trim(shard, POLICY_B2, b2 - 1);
+	}
+	if ((elem = policyi_lru(shard, POLICY_FREE)))
+		return policyi_evict(shard, elem, -1);
+	/* Replace */
+	if (t1 > 0 && (t1 > state->p || (in_b2 && t1 == state->p)) &&
+	    (elem = policyi_lru(shard, POLICY_T1)))
+		return policyi_evict(shard, elem, POLICY_B1);
+	if ((elem = policyi_lru(shard, POLICY_T2)))
+		return policyi_evict(shard, elem, POLICY_B2);
+	if ((elem = policyi_lru(shard, POLICY_T1)))
+		return policyi_evict(shard, elem, POLICY_B1);
+	return NULL;
+}
+
+const struct CachePolicy cache_policy_arc = {
+	"arc", policy_init, policy_free, policy_add, arc_hit, arc_victim,
+	policy_admit, policy_drop
+};
@@ -1,32 +1,215 @@
 #include <string.h>
+#include <stdlib.h>
 
+#include "dbg.h"
 #include "node.h"
+#include "cache.h"
+#include "blob.h"
+#include "pack.h"
 #include "btree.h"
 #include "search.h"
 
 /**
- * @brief  B-Tree search operation
+ * @brief  Copy value of the key at position pos into newly allocated memory
  *
  * @return Status
  */
-pageno_t btreei_search(struct DB *db, struct BTreeNode *node,
-		       void *key, size_t *val_len) {
+int btreei_search_value(struct DB *db, struct BTreeNode *node,
+			       size_t pos, void **val, size_t *val_len) {
+	if (NODE_BLOB(node, pos))
+		return blob_read(db, NODE_VAL(node, pos), val, val_len);
+	if (NODE_PACKED(node, pos))
+		return pack_read(db, NODE_VAL(node, pos), val, val_len);
+	if (NODE_INLINE(node, pos)) {
+		*val_len = NODE_VAL(node, pos);
+		*val = malloc(*val_len + 1);
+		check_mem(*val, *val_len + 1);
+		memcpy(*val, NODE_INLINE_VAL(node, pos), *val_len);
+	} else {
+		struct DataNode dnode;
+		node_data_load(db, &dnode, NODE_VAL(node, pos));
+		*val_len = dnode.h->size;
+		*val = malloc(*val_len + 1);
+		check_mem(*val, *val_len + 1);
+		memcpy(*val, dnode.data, *val_len);
+		node_free(db, &dnode);
+	}
+	((char *)*val)[*val_len] = 0;
+	return 0;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief  B-Tree search operation
+ *
+ * @return 1 if key is found (and value is copied into *val), 0 otherwise
+ */
+int btreei_search(struct DB *db, struct BTreeNode *node,
+		  void *key, size_t key_len, void **val, size_t *val_len) {
 	*val_len = 0;
-	size_t pos = 0;
-	int cmp = 0;
-	while (pos < node->h->size) {
-		cmp = strncmp(NODE_KEY_POS(node, pos), key, BTREE_KEY_LEN);
-		if (cmp >= 0)
-			break;
-		pos++;
-	}
-	if (pos < node->h->size && cmp == 0)
-		return node->vals[pos];
-	if (node->h->flags & IS_LEAF)
-		return 0;
+	if (node->h->flags & IS_LEAF) {
+		int cmp = 0;
+		size_t pos = node_key_search(node, key, key_len, &cmp);
+		if (cmp)
+			return 0;
+		return btreei_search_value(db, node, pos, val, val_len) == 0;
+	}
 	struct BTreeNode kid;
-	node_btree_load(db, &kid, node->chld[pos]);
-	pageno_t ret = btreei_search(db, &kid, key, val_len);
+	size_t pos = node_key_child(node, key, key_len);
+	node_btree_load(db, &kid, NODE_CHLD(node, pos));
+	int ret = btreei_search(db, &kid, key, key_len, val, val_len);
 	node_free(db, &kid);
 	return ret;
 }
+
+/*
+ * End of the group of sorted keys [from, to), which subtree of the child
+ * at position pos may hold
+ */
+static size_t btreei_search_group(struct BTreeNode *node, size_t pos,
+				  struct DBItem **items, size_t from, size_t to) {
+	size_t end = from + 1;
+	while (end < to && (pos == node->h->size ||
+	       node_key_cmp(node, pos, items[end]->key, items[end]->key_len) > 0))
+		++end;
+	return end;
+}
+
+/*
+ * Search sorted keys [from, to) in the subtree of the node. Children (and
+ * data pages of the leaf), needed by the keys, are queued for reading all
+ * at once before the first of them is visited. Positions of keys in the
+ * leaf are kept in pos (one per key of the batch, indexed as items).
+ */
+static void btreei_search_items(struct DB *db, struct BTreeNode *node,
+				struct DBItem **items, size_t from, size_t to,
+				size_t *pos) {
+	struct CacheBase *cache = db->pool->cache;
+	size_t i = 0, end = 0;
+	if (node->h->flags & IS_LEAF) {
+		int    cmp = 0;
+		for (i = from; i < to; ++i) {
+			pos[i] = node_key_search(node, items[i]->key,
+						 items[i]->key_len, &cmp);
+			if (cmp)
+				pos[i] = node->h->size;
+			else if (NODE_PACKED(node, pos[i]))
+				cache_page_prefetch(cache, PACK_PAGE(NODE_VAL(node, pos[i])));
+			else if (!NODE_INLINE(node, pos[i]) &&
+				 !NODE_BLOB(node, pos[i]))
+				cache_page_prefetch(cache, NODE_VAL(node, pos[i]));
+		}
+		for (i = from; i < to; ++i) {
+			items[i]->val     = NULL;
+			items[i]->val_len = 0;
+			if (pos[i] < node->h->size)
+				btreei_search_value(db, node, pos[i],
+						    &items[i]->val, &items[i]->val_len);
+		}
+		return;
+	}
+	for (i = from; i < to; i = end) {
+		size_t child = node_key_child(node, items[i]->key, items[i]->key_len);
+		end = btreei_search_group(node, child, items, i, to);
+		cache_page_prefetch(cache, NODE_CHLD(node, child));
+	}
+	for (i = from; i < to; i = end) {
+		struct BTreeNode kid;
+		size_t child = node_key_child(node, items[i]->key, items[i]->key_len);
+		end = btreei_search_group(node, child, items, i, to);
+		node_btree_load(db, &kid, NODE_CHLD(node, child));
+		btreei_search_items(db, &kid, items, i, end, pos);
+		node_free(db, &kid);
+	}
+}
+
+static int btreei_item_cmp(const void *a, const void *b) {
+	const struct DBItem *l = *(const struct DBItem **)a;
+	const struct DBItem *r = *(const struct DBItem **)b;
+	return node_key_cmp_raw(l->key, l->key_len, r->key, r->key_len);
+}
+
+/**
+ * @brief  B-Tree search operation for the batch of keys: keys are sorted
+ *         and looked up in one walk of the tree, values are copied into
+ *         newly allocated memory (val is NULL, if key isn't found)
+ *
+ * @return Status
+ */
+int btreei_search_many(struct DB *db, struct BTreeNode *node,
+		       struct DBItem *items, size_t count) {
+	struct DBItem **sorted = malloc(count * sizeof(struct DBItem *));
+	check_mem(sorted, count * sizeof(struct DBItem *));
+	/* All keys may fall into one leaf, so positions don't go on the stack */
+	size_t *pos = malloc(count * sizeof(size_t));
+	check_mem(pos, count * sizeof(size_t));
+	size_t i = 0;
+	for (i = 0; i < count; ++i)
+		sorted[i] = &items[i];
+	qsort(sorted, count, sizeof(struct DBItem *), btreei_item_cmp);
+	btreei_search_items(db, node, sorted, 0, count, pos);
+	free(pos);
+	free(sorted);
+	return 0;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief  B-Tree search operation without copying of the value: page with
+ *         the value stays pinned in the cache until pin is released
+ *
+ * @return 1 if key is found, 0 otherwise
+ */
+int btreei_search_pinned(struct DB *db, struct BTreeNode *node,
+			 void *key, size_t key_len, struct DBPin *pin) {
+	struct BTreeNode leaf = *node, kid;
+	memset(pin, 0, sizeof(struct DBPin));
+	pin->db = db;
+	while (!(leaf.h->flags & IS_LEAF)) {
+		size_t pos = node_key_child(&leaf, key, key_len);
+		node_btree_load(db, &kid, NODE_CHLD(&leaf, pos));
+		if (leaf.h != node->h)
+			node_free(db, &leaf);
+		leaf = kid;
+	}
+	int cmp = 0;
+	size_t pos = node_key_search(&leaf, key, key_len, &cmp);
+	if (cmp == 0 && NODE_INLINE(&leaf, pos)) {
+		/* Value is in the leaf itself: it stays pinned for the caller */
+		if (leaf.h == node->h)
+			cache_page_get(db->pool->cache, leaf.h->page);
+		pin->page    = leaf.h->page;
+		pin->val     = NODE_INLINE_VAL(&leaf, pos);
+		pin->val_len = NODE_VAL(&leaf, pos);
+		return 1;
+	}
+	if (cmp == 0 && NODE_BLOB(&leaf, pos)) {
+		/* Blobs bypass the cache, so pin holds a private copy */
+		blob_read(db, NODE_VAL(&leaf, pos), &pin->val, &pin->val_len);
+	} else if (cmp == 0 && NODE_PACKED(&leaf, pos)) {
+		/* Packed value is decompressed into a private copy too */
+		pack_read(db, NODE_VAL(&leaf, pos), &pin->val, &pin->val_len);
+	} else if (cmp == 0) {
+		struct DataNode dnode;
+		node_data_load(db, &dnode, NODE_VAL(&leaf, pos));
+		pin->page    = dnode.h->page;
+		pin->val     = dnode.data;
+		pin->val_len = dnode.h->size;
+	}
+	if (leaf.h != node->h)
+		node_free(db, &leaf);
+	return (cmp == 0);
+}
+
+/**
+ * @brief  Unpin page, held by pin (or free the copy of the value)
+ */
+void btreei_search_release(struct DBPin *pin) {
+	if (pin->page)
+		cache_page_free(pin->db->pool->cache, pin->page);
+	else
+		free(pin->val);
+	memset(pin, 0, sizeof(struct DBPin));
+}
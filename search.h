@@ -1,7 +1,14 @@
 #ifndef _BTREE_SEARCH_H_
 #define _BTREE_SEARCH_H_
 
-pageno_t btreei_search(struct DB *db, struct BTreeNode *node,
-		       void *key, size_t *val_len);
+int btreei_search_value(struct DB *db, struct BTreeNode *node,
+			size_t pos, void **val, size_t *val_len);
+int btreei_search(struct DB *db, struct BTreeNode *node,
+		  void *key, size_t key_len, void **val, size_t *val_len);
+int btreei_search_pinned(struct DB *db, struct BTreeNode *node,
+			 void *key, size_t key_len, struct DBPin *pin);
+void btreei_search_release(struct DBPin *pin);
+int btreei_search_many(struct DB *db, struct BTreeNode *node,
+		       struct DBItem *items, size_t count);
 
 #endif /* _BTREE_SEARCH_H_ */
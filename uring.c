@@ -0,0 +1,159 @@
+#define _DEFAULT_SOURCE
+
+#include "uring.h"
+#include "dbg.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>      /* syscall */
+#include <sys/mman.h>    /* mmap
+			  * munmap
+			  */
+#include <sys/syscall.h> /* __NR_io_uring_* */
+
+#define uring_load(P)     __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define uring_store(P, V) __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+
+/**
+ * @brief         Set up the ring
+ *
+ * @param ring    Ring to initialize
+ * @param entries Maximum number of requests in flight
+ *
+ * @return        Status (-1 if io_uring isn't available, e.g. old kernel)
+ */
+int uring_init(struct URing *ring, unsigned entries) {
+	struct io_uring_params p;
+	memset(ring, 0, sizeof(struct URing));
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		log_info("io_uring isn't available (%s)", strerror(errno));
+		ring->fd = -1;
+		return -1;
+	}
+	ring->entries = p.sq_entries;
+	ring->sq_len  = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len  = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	check(ring->sq_ptr != MAP_FAILED, "Can't map submission ring");
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		check(ring->cq_ptr != MAP_FAILED, "Can't map completion ring");
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	check(ring->sqes != MAP_FAILED, "Can't map submission entries");
+
+	ring->sq_head  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+	ring->cq_head  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+	return 0;
+error:
+	if (ring->sq_ptr == MAP_FAILED) ring->sq_ptr = NULL;
+	if (ring->cq_ptr == MAP_FAILED) ring->cq_ptr = NULL;
+	if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+	uring_free(ring);
+	return -1;
+}
+
+/**
+ * @brief      Release the ring (requests in flight should be reaped first)
+ */
+void uring_free(struct URing *ring) {
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	memset(ring, 0, sizeof(struct URing));
+	ring->fd = -1;
+}
+
+/**
+ * @brief        Queue read (IORING_OP_READ) or write (IORING_OP_WRITE) of
+ *               len bytes at offset of the file. It's started by
+ *               uring_submit.
+ *
+ * @param data   Value, passed to the completion callback
+ *
+ * @return       Status (-1 if submission ring is full)
+ */
+int uring_queue(struct URing *ring, int opcode, int fd, void *buf,
+		size_t len, size_t offset, uint64_t data) {
+	unsigned tail = *ring->sq_tail;
+	if (tail - uring_load(ring->sq_head) >= ring->entries)
+		return -1;
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode    = opcode;
+	sqe->fd        = fd;
+	sqe->addr      = (uint64_t )(uintptr_t )buf;
+	sqe->len       = len;
+	sqe->off       = offset;
+	sqe->user_data = data;
+	ring->sq_array[idx] = idx;
+	uring_store(ring->sq_tail, tail + 1);
+	ring->queued++;
+	return 0;
+}
+
+/**
+ * @brief      Start queued requests
+ *
+ * @param wait Wait until at least that many requests are completed
+ *
+ * @return     Status
+ */
+int uring_submit(struct URing *ring, unsigned wait) {
+	if (ring->queued == 0 && wait == 0)
+		return 0;
+	int retval = 0;
+	do {
+		retval = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+				 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (retval == -1 && errno == EINTR);
+	check(retval != -1, "io_uring_enter failed");
+	ring->queued -= retval;
+	return 0;
+error:
+	return -1;
+}
+
+/**
+ * @brief      Pass every completed request to done
+ *
+ * @return     Number of completions
+ */
+int uring_reap(struct URing *ring, uring_done_t done, void *arg) {
+	unsigned head = *ring->cq_head, count = 0;
+	while (head != uring_load(ring->cq_tail)) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		uint64_t data = cqe->user_data;
+		int      res  = cqe->res;
+		uring_store(ring->cq_head, ++head);
+		done(arg, data, res);
+		count++;
+	}
+	return count;
+}
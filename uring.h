@@ -0,0 +1,41 @@
+#ifndef   _BTREE_URING_H_
+#define   _BTREE_URING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring over raw syscalls: one submission and one completion
+ * ring, used by a single thread (the dumper), so no locking is needed.
+ */
+struct URing {
+	int                  fd;
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_array;
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void                *sq_ptr;
+	void                *cq_ptr;
+	size_t               sq_len;
+	size_t               cq_len;
+	size_t               sqes_len;
+	unsigned             entries;
+	unsigned             queued; /* SQEs, not submitted yet */
+};
+
+typedef void (*uring_done_t)(void *arg, uint64_t data, int res);
+
+int  uring_init  (struct URing *ring, unsigned entries);
+void uring_free  (struct URing *ring);
+int  uring_queue (struct URing *ring, int opcode, int fd, void *buf,
+		  size_t len, size_t offset, uint64_t data);
+int  uring_submit(struct URing *ring, unsigned wait);
+int  uring_reap  (struct URing *ring, uring_done_t done, void *arg);
+
+#endif /* _BTREE_URING_H_ */
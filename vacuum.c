@@ -0,0 +1,182 @@
+#include <stdlib.h>
+
+#include "dbg.h"
+#include "node.h"
+#include "blob.h"
+#include "pack.h"
+#include "btree.h"
+#include "pagepool.h"
+#include "vacuum.h"
+#include "wal.h"
+
+#include <uthash.h>
+
+/*
+ * Online compaction of the pool. The tree is walked from the top in the
+ * order of keys, every page met is moved into the first empty page of the
+ * pool, if there's one before it (see node_relocate), and the reference
+ * to it is fixed. So live pages are packed at the start of the pool in
+ * the order of the walk: node, then it's subtrees, leaf is followed by
+ * it's data pages. Empty tail of the file is cut off at the end.
+ *
+ * Packed page is referenced by many keys: it's moved, when the first one
+ * is met, the rest are fixed from the table of moved packed pages. Before
+ * that values of packed pages, that are less than half full, are moved
+ * together by the separate walk (see pack_compact), so emptied pages are
+ * freed before pages are moved.
+ */
+
+struct VacuumMove {
+	pageno_t from;
+	pageno_t to;
+	UT_hash_handle hh;
+};
+
+struct Vacuum {
+	struct DB         *db;
+	int                repack; /* Walk moves packed values only */
+	pageno_t           moved;
+	pageno_t           repacked;
+	struct VacuumMove *packs; /* Moved packed pages */
+};
+
+/*
+ * Move page of the node, returns it's new page
+ */
+static pageno_t btreei_vacuum_page(struct Vacuum *vc, pageno_t page) {
+	if (vc->repack)
+		return page;
+	pageno_t to = node_relocate(vc->db, page);
+	if (to != page)
+		vc->moved++;
+	return to;
+}
+
+/*
+ * Move page of the packed value, returns new reference to the value
+ */
+static pageno_t btreei_vacuum_pack(struct Vacuum *vc, pageno_t ref) {
+	pageno_t page = PACK_PAGE(ref);
+	struct VacuumMove *mv = NULL;
+	HASH_FIND(hh, vc->packs, &page, sizeof(pageno_t), mv);
+	if (mv)
+		return PACK_REF(mv->to, PACK_SLOT(ref));
+	pageno_t to = btreei_vacuum_page(vc, page);
+	if (to == page)
+		return ref;
+	mv = (struct VacuumMove *)malloc(sizeof(struct VacuumMove));
+	check_mem(mv, sizeof(struct VacuumMove));
+	mv->from = page;
+	mv->to   = to;
+	HASH_ADD(hh, vc->packs, from, sizeof(pageno_t), mv);
+	return PACK_REF(to, PACK_SLOT(ref));
+error:
+	exit(-1);
+}
+
+/*
+ * Point neighbours of the moved leaf to it's new page
+ */
+static void btreei_vacuum_link(struct DB *db, struct BTreeNode *leaf) {
+	struct BTreeNode sib;
+	if (leaf->h->prev) {
+		node_btree_load(db, &sib, leaf->h->prev);
+		node_write(db, &sib);
+		sib.h->next = leaf->h->page;
+		node_btree_dump(db, &sib);
+		node_free(db, &sib);
+	}
+	if (leaf->h->next) {
+		node_btree_load(db, &sib, leaf->h->next);
+		node_write(db, &sib);
+		sib.h->prev = leaf->h->page;
+		node_btree_dump(db, &sib);
+		node_free(db, &sib);
+	}
+}
+
+/*
+ * Move values of the leaf
+ * Returns 1 if leaf is changed (isn't dumped)
+ */
+static int btreei_vacuum_leaf(struct Vacuum *vc, struct BTreeNode *node) {
+	int    dirty = 0;
+	size_t pos   = 0;
+	for (pos = 0; pos < node->h->size; ++pos) {
+		if (NODE_INLINE(node, pos))
+			continue;
+		pageno_t val = NODE_VAL(node, pos), to = val;
+		if (vc->repack) {
+			if (NODE_PACKED(node, pos))
+				vc->repacked += pack_compact(vc->db, &to);
+		} else if (NODE_BLOB(node, pos))
+			vc->moved += blob_relocate(vc->db, &to);
+		else if (NODE_PACKED(node, pos))
+			to = btreei_vacuum_pack(vc, val);
+		else
+			to = btreei_vacuum_page(vc, val);
+		if (to != val) {
+			node_write(vc->db, node);
+			NODE_VAL(node, pos) = to;
+			dirty = 1;
+		}
+	}
+	return dirty;
+}
+
+/*
+ * Move children of the node (with their subtrees)
+ * Returns 1 if node is changed (isn't dumped)
+ */
+static int btreei_vacuum_node(struct Vacuum *vc, struct BTreeNode *node) {
+	if (node->h->flags & IS_LEAF)
+		return btreei_vacuum_leaf(vc, node);
+	struct DB *db = vc->db;
+	int    dirty = 0;
+	size_t pos   = 0;
+	for (pos = 0; pos <= node->h->size; ++pos) {
+		pageno_t page = NODE_CHLD(node, pos);
+		pageno_t to   = btreei_vacuum_page(vc, page);
+		struct BTreeNode kid;
+		node_btree_load(db, &kid, to);
+		if (to != page) {
+			node_write(db, node);
+			NODE_CHLD(node, pos) = to;
+			dirty = 1;
+			if (kid.h->flags & IS_LEAF)
+				btreei_vacuum_link(db, &kid);
+		}
+		if (btreei_vacuum_node(vc, &kid))
+			node_btree_dump(db, &kid);
+		node_free(db, &kid);
+	}
+	return dirty;
+}
+
+/**
+ * @brief  Compact the pool and shrink the file
+ *
+ * @return Status
+ */
+int btreei_vacuum(struct DB *db) {
+	struct Vacuum vc = {.db = db, .repack = (db->compress != 0)};
+	wal_write_begin(db, OP_VACUUM, NULL, 0, NULL, 0);
+	for (; vc.repack >= 0; --vc.repack)
+		if (btreei_vacuum_node(&vc, db->top))
+			node_btree_dump(db, db->top);
+	wal_write_finish(db);
+
+	struct VacuumMove *mv = NULL, *tmp = NULL;
+	HASH_FIND(hh, vc.packs, &db->pack, sizeof(pageno_t), mv);
+	if (mv)
+		db->pack = mv->to;
+	HASH_ITER(hh, vc.packs, mv, tmp) {
+		HASH_DEL(vc.packs, mv);
+		free(mv);
+	}
+	pageno_t cut = pool_truncate(db->pool);
+	log_info("Vacuum moved %zd values and %zd pages, pool is shrunk by "
+		 "%zd pages", vc.repacked, vc.moved, cut);
+	(void)cut; /* Used only by the log (see NDEBUG) */
+	return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef _BTREE_VACUUM_H_
+#define _BTREE_VACUUM_H_
+
+#include "btree.h"
+
+int btreei_vacuum(struct DB *db);
+
+#endif /* _BTREE_VACUUM_H_ */
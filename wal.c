@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE
+
 #include "wal.h"
 
 #include <sys/uio.h>
@@ -9,7 +11,7 @@
 #include "btree.h"
 #include "dbg.h"
 #include "cache.h"
-#include <uthash.h>
+#include "pagepool.h"
 
 static int wali_list_enqueue(struct WAL *wal, struct WALElem *elem) {
 	pthread_mutex_lock (&wal->list_lock);
@@ -117,10 +119,13 @@ static int wali_write_append(struct WAL *wal, struct NodeHeader *header_old,
 }
 
 int wal_write_append(struct DB *db, pageno_t page) {
-	struct CacheElem *elem = NULL;
-	HASH_FIND_INT(db->pool->cache->hash, &page, elem);
+	struct CacheElem *elem = cachei_page_find(db->pool->cache, page);
 	check(elem != NULL, "Can't find needed page")
-	return wali_write_append(db->wal, elem->cache, elem->prev);
+	/* New page has no before-image */
+	wali_write_append(db->wal, elem->cache,
+			  elem->before ? elem->before : elem->cache);
+	cachei_page_release(db->pool->cache, elem);
+	return 0;
 error:
 	exit(-1);
 }
@@ -129,7 +134,7 @@ error:
  * 	int32_t magic = 0xd5ab0bad;
  * } */
 static int wali_write_finish(struct WAL *wal) {
-	struct WALHeader3 wal_line = WALHEADER2_INIT();
+	struct WALHeader3 wal_line = WALHEADER3_INIT();
 	struct iovec vec[1];
 	vec[0].iov_base = (void *)&wal_line;
 	vec[0].iov_len = sizeof(struct WALHeader3);
@@ -180,6 +185,54 @@ error:
 	return procret;
 }
 
+/**
+ * @brief  Rebuild allocation state after crash: bitmask isn't written on
+ *         every allocation, so every page, which image is in the WAL, is
+ *         marked as used (page, freed after it's last image, is leaked,
+ *         but never given out twice). Must be called before wal_init.
+ *
+ * @return Status
+ */
+int wal_recover(struct DB *db) {
+	char wal_name[129] = {0};
+	snprintf(wal_name, 129, "%s.wal", db->db_name);
+	int fd = open(wal_name, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	size_t page_size = db->pool->page_size;
+	struct NodeHeader *h = malloc(page_size);
+	check_mem(h, page_size);
+	off_t  off = 0;
+	size_t count = 0;
+	int32_t magic = 0;
+	/* Log may end with partially written (or stale) record */
+	while (pread(fd, &magic, sizeof(int32_t), off) == sizeof(int32_t)) {
+		if (magic == WAL_MAGIC1) {
+			struct WALHeader1 w1;
+			if (pread(fd, &w1, sizeof(w1), off) != sizeof(w1))
+				break;
+			off += sizeof(w1) + w1.key_size + w1.val_size;
+		} else if (magic == WAL_MAGIC2) {
+			off += sizeof(struct WALHeader2);
+			if (pread(fd, h, page_size, off) != (ssize_t )page_size ||
+			    pool_reserve(db->pool, h->page) == -1)
+				break;
+			off += 2 * page_size;
+			count++;
+		} else if (magic == WAL_MAGIC3) {
+			off += sizeof(struct WALHeader3);
+		} else {
+			break;
+		}
+	}
+	log_info("Allocations of %zd page images are recovered from the WAL", count);
+	free(h);
+	close(fd);
+	return 0;
+error:
+	exit(-1);
+}
+
 int wal_init (struct DB *db, struct WAL *wal) {
 	pthread_attr_t attr;
 	pthread_attr_init(&attr);
@@ -210,6 +263,8 @@ int wal_free(struct WAL *wal) {
 	log_err("wal_loop exited with status %d", (int )(*(int *)status));
 	free(status);
 	pthread_mutex_destroy(&wal->list_lock);
+	/* Pages and bitmask are flushed by now: nothing to recover from log */
+	check(ftruncate(wal->fd, 0) == 0, "Failed to truncate WAL");
 	wal->fd = close(wal->fd);
 	check(wal->fd != -1, "Failed to close file descriptor for WAL");
 	wal->fd = 0;
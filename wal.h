@@ -32,7 +32,10 @@ struct WALHeader1 {
 	int8_t   op;
 #define OP_INSERT 0x00
 #define OP_DELETE 0x01
-	int8_t   key_size;
+#define OP_BULK   0x02
+#define OP_BATCH  0x03
+#define OP_VACUUM 0x04
+	uint8_t  key_size;
 	int64_t  val_size;
 };
 
@@ -44,14 +47,19 @@ struct WALHeader3 {
 	int32_t magic; /* 0xd5ab0bad */
 };
 
-#define WALHEADER1_INIT(...) { .magic = 0xd5ab0bab, ## __VA_ARGS__ }
-#define WALHEADER2_INIT(...) { .magic = 0xd5ab0bac, ## __VA_ARGS__ }
-#define WALHEADER3_INIT(...) { .magic = 0xd5ab0bad, ## __VA_ARGS__ }
+#define WAL_MAGIC1 ((int32_t )0xd5ab0bab)
+#define WAL_MAGIC2 ((int32_t )0xd5ab0bac)
+#define WAL_MAGIC3 ((int32_t )0xd5ab0bad)
+
+#define WALHEADER1_INIT(...) { .magic = WAL_MAGIC1, ## __VA_ARGS__ }
+#define WALHEADER2_INIT(...) { .magic = WAL_MAGIC2, ## __VA_ARGS__ }
+#define WALHEADER3_INIT(...) { .magic = WAL_MAGIC3, ## __VA_ARGS__ }
 
 int wal_write_begin(struct DB *db, int8_t op_type, void *key,
 		size_t key_size, void *val, size_t val_size);
 int wal_write_append(struct DB *db, pageno_t page);
 int wal_write_finish(struct DB *db);
+int wal_recover(struct DB *db);
 int wal_init (struct DB *db, struct WAL *wal);
 int wal_free(struct WAL *wal);
 
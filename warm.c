@@ -0,0 +1,267 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "dbg.h"
+#include "cache.h"
+#include "pagepool.h"
+#include "warm.h"
+
+/*
+ * Warm set: numbers of pages, that are cached, sorted. It's saved into
+ * <db>.warm by the warmer thread every WARM_PERIOD seconds and on db_free.
+ * When DB is opened, the warmer reads these pages into the cache, while
+ * DB serves requests (getter of the page, that isn't read yet, waits for
+ * it, as for the dumper): pages go in the order of numbers, runs of them
+ * (with small gaps) are read at once straight into their frames.
+ */
+
+#define WARM_MAGIC  0x4d524157 /* "WARM" */
+#define WARM_PERIOD 60         /* Seconds between saves */
+#define WARM_RUN    64         /* Most pages in one read */
+#define WARM_GAP    4          /* Most pages, read in vain to join runs */
+
+struct WarmHeader {
+	uint32_t magic;
+	uint32_t page_size;
+	uint64_t count;
+};
+
+static void warmi_name(struct DB *db, char *name, const char *suffix) {
+	snprintf(name, 129, "%s.warm%s", db->db_name, suffix);
+}
+
+static int warmi_cmp(const void *a, const void *b) {
+	pageno_t x = *(const pageno_t *)a, y = *(const pageno_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Numbers of cached pages (not the ones, that are being read, nor the ones,
+ * that are freed)
+ */
+static pageno_t *warmi_collect(struct CacheBase *cache, size_t *count) {
+	pageno_t *pages = malloc(cache->frames * sizeof(pageno_t));
+	check_mem(pages, cache->frames * sizeof(pageno_t));
+	struct CacheElem *elem = NULL;
+	*count = 0;
+	/* Frames, added meanwhile, aren't counted in cache->frames */
+	for (elem = cache->list_tail; elem && *count < cache->frames;
+	     elem = elem->next) {
+		pageno_t page = elem->id;
+		struct CacheShard *shard = cachei_shard(cache, page);
+		pthread_mutex_lock(&shard->latch);
+		if (cachei_hash_find(shard, page) == elem &&
+		    !(elem->flag & CACHE_LOAD) && pool_page_used(cache->pool, page))
+			pages[(*count)++] = page;
+		pthread_mutex_unlock(&shard->latch);
+	}
+	qsort(pages, *count, sizeof(pageno_t), warmi_cmp);
+	return pages;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief  Save warm set of the cache. It's written aside and renamed, so
+ *         the previous one is kept, if it fails.
+ *
+ * @return Status
+ */
+int warm_save(struct DB *db) {
+	char name[129] = {0}, tmp[129] = {0};
+	size_t count = 0;
+	pageno_t *pages = warmi_collect(db->pool->cache, &count);
+	struct WarmHeader h = {WARM_MAGIC, db->pool->page_size, count};
+	warmi_name(db, name, "");
+	warmi_name(db, tmp, ".tmp");
+	int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY,
+		      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	check(fd != -1, "Failed to open warm set %s", tmp);
+	check(write(fd, &h, sizeof(h)) == sizeof(h) &&
+	      write(fd, pages, count * sizeof(pageno_t)) ==
+	      (ssize_t )(count * sizeof(pageno_t)),
+	      "Failed to write warm set %s", tmp);
+	check(close(fd) == 0 && rename(tmp, name) == 0,
+	      "Failed to save warm set %s", name);
+	log_info("Warm set of %zd pages is saved", count);
+	free(pages);
+	return 0;
+error:
+	if (fd != -1) {
+		close(fd);
+		unlink(tmp);
+	}
+	free(pages);
+	return -1;
+}
+
+/*
+ * Load saved warm set (NULL if there's none or it doesn't fit the pool)
+ */
+static pageno_t *warmi_load(struct DB *db, size_t *count) {
+	char name[129] = {0};
+	struct WarmHeader h;
+	pageno_t *pages = NULL;
+	warmi_name(db, name, "");
+	int fd = open(name, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	check(read(fd, &h, sizeof(h)) == sizeof(h) && h.magic == WARM_MAGIC &&
+	      h.page_size == db->pool->page_size &&
+	      h.count <= (uint64_t )db->pool->nPages, "Warm set %s is broken", name);
+	if (h.count == 0) {
+		close(fd);
+		return NULL;
+	}
+	pages = malloc(h.count * sizeof(pageno_t));
+	check_mem(pages, h.count * sizeof(pageno_t));
+	check(read(fd, pages, h.count * sizeof(pageno_t)) ==
+	      (ssize_t )(h.count * sizeof(pageno_t)), "Warm set %s is short", name);
+	close(fd);
+	*count = h.count;
+	return pages;
+error:
+	close(fd);
+	free(pages);
+	return NULL;
+}
+
+/*
+ * Read run of pages from pages[0] up to (not including) page end into the
+ * frames, claimed for them. Gaps, pages, that are cached already, and pages,
+ * that are freed since the warm set was saved (disk copy of such page is
+ * stale), are read into the scratch page.
+ */
+static size_t warmi_read_run(struct DB *db, pageno_t *pages, size_t count,
+			     pageno_t end, void *scratch) {
+	struct CacheBase *cache = db->pool->cache;
+	struct CacheElem *elems[WARM_RUN];
+	struct iovec      iov[WARM_RUN];
+	pageno_t page = pages[0];
+	size_t   n = 0, i = 0, claimed = 0, total = 0;
+	for (; page < end; ++page, ++n) {
+		elems[n] = NULL;
+		if (i < count && pages[i] == page) {
+			if (pool_page_used(db->pool, page))
+				elems[n] = cachei_page_claim(cache, page);
+			claimed += (elems[n] != NULL);
+			i++;
+		}
+		iov[n].iov_base = (elems[n] ? elems[n]->cache : scratch);
+		iov[n].iov_len  = db->pool->page_size;
+	}
+	if (claimed > 0)
+		pool_readv(db->pool, iov, n, pages[0], 0);
+	for (total = n, n = 0; n < total; ++n)
+		if (elems[n])
+			cachei_page_loaded(cache, elems[n]);
+	return claimed;
+}
+
+/*
+ * Read saved warm set into the cache. Pages above the end of the pool are
+ * skipped, so are the last ones, if there're more, than the cache holds.
+ */
+static void warmi_prewarm(struct DB *db) {
+	size_t count = 0, i = 0, j = 0, reads = 0, loaded = 0;
+	pageno_t *pages = warmi_load(db, &count);
+	if (pages == NULL)
+		return;
+	void *scratch = pool_page_alloc(db->pool, 1);
+	while (count > 0 && pages[count - 1] >= db->pool->nPages)
+		count--;
+	if (count > db->pool->cache->frames - db->pool->cache->frames / 8)
+		count = db->pool->cache->frames - db->pool->cache->frames / 8;
+	for (i = 0; i < count && db->warm_enable; i = j) {
+		/* Run ends at the big gap or when it's WARM_RUN pages long */
+		for (j = i + 1; j < count && pages[j] - pages[j - 1] <= WARM_GAP + 1 &&
+		     pages[j] - pages[i] < WARM_RUN; ++j)
+			;
+		size_t got = warmi_read_run(db, pages + i, j - i, pages[j - 1] + 1,
+					    scratch);
+		loaded += got;
+		reads  += (got > 0);
+	}
+	log_info("Cache is prewarmed with %zd pages in %zd reads", loaded, reads);
+	free(scratch);
+	free(pages);
+}
+
+static void *warm_loop(void *arg) {
+	struct DB *db = (struct DB *)arg;
+	struct timespec ts = {0, 0};
+	warmi_prewarm(db);
+	pthread_mutex_lock(&db->warm_lock);
+	db->warming = 0;
+	pthread_cond_broadcast(&db->warm_signal);
+	while (db->warm_enable) {
+		ts.tv_sec = time(NULL) + WARM_PERIOD;
+		pthread_cond_timedwait(&db->warm_signal, &db->warm_lock, &ts);
+		if (!db->warm_enable || time(NULL) < ts.tv_sec)
+			continue;
+		pthread_mutex_unlock(&db->warm_lock);
+		warm_save(db);
+		pthread_mutex_lock(&db->warm_lock);
+	}
+	pthread_mutex_unlock(&db->warm_lock);
+	return NULL;
+}
+
+/**
+ * @brief  Start the warmer thread: it prewarms the cache with saved warm
+ *         set (see warm_wait) and saves it periodically
+ *
+ * @return Status
+ */
+int warm_init(struct DB *db) {
+	pthread_mutex_init(&db->warm_lock, NULL);
+	pthread_cond_init(&db->warm_signal, NULL);
+	db->warm_enable = 1;
+	db->warming     = 1;
+	check(pthread_create(&db->warmer, NULL, warm_loop, db) == 0,
+	      "Failed to start warmer");
+	return 0;
+error:
+	exit(-1);
+}
+
+/**
+ * @brief  Wait until the cache is prewarmed (pages, that are going to be
+ *         read, mustn't be cut off the pool meanwhile)
+ */
+void warm_wait(struct DB *db) {
+	pthread_mutex_lock(&db->warm_lock);
+	while (db->warming)
+		pthread_cond_wait(&db->warm_signal, &db->warm_lock);
+	pthread_mutex_unlock(&db->warm_lock);
+}
+
+/**
+ * @brief  Stop the warmer (prewarm is cut short) and save warm set
+ *
+ * @return Status
+ */
+int warm_free(struct DB *db) {
+	pthread_mutex_lock(&db->warm_lock);
+	db->warm_enable = 0;
+	pthread_cond_broadcast(&db->warm_signal);
+	pthread_mutex_unlock(&db->warm_lock);
+	pthread_join(db->warmer, NULL);
+	pthread_mutex_destroy(&db->warm_lock);
+	pthread_cond_destroy(&db->warm_signal);
+	return warm_save(db);
+}
+
+/**
+ * @brief  Forget saved warm set (of the DB, that is created anew)
+ */
+void warm_drop(struct DB *db) {
+	char name[129] = {0};
+	warmi_name(db, name, "");
+	unlink(name);
+}
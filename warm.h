@@ -0,0 +1,12 @@
+#ifndef _BTREE_WARM_H_
+#define _BTREE_WARM_H_
+
+#include "btree.h"
+
+int  warm_init(struct DB *db);
+int  warm_free(struct DB *db);
+int  warm_save(struct DB *db);
+void warm_wait(struct DB *db);
+void warm_drop(struct DB *db);
+
+#endif /* _BTREE_WARM_H_ */